@@ -4,11 +4,46 @@ Extract raw difference values from Canon raw files .CR2
 
 The console application takes two arguments.
 
-main.a <input> <output>
+main.a [options] <input> <output>
 
 <input>     name of the input Canon raw file, e.g image.CR2
 <output>     name of the output file, e.g DIFF_VALUES.dat
 
+Options:
+
+--huff-search    decode with the original linear Huffman code search instead of the lookup table (for comparisons, implies --legacy-bits)
+--legacy-bits    read the scan with the original byte at a time ByteStream reader
+--no-simd        do not use SSE2 when removing stuffed bytes from the scan
+--mmap           map the input file into memory instead of reading it with fread
+--seam-correct   interpolate the first 4 difference values of every other scan row, by default only for the
+                 camera models known to need it; --no-seam-correct never does
+--bands <rows>   decode and process the image in bands of <rows> rows to bound the memory use
+--photosites     write the 16 bit sensor values of the whole frame instead of 8 bit accumulated differences
+--demosaic <m>   with --photosites, write 16 bit RGB demosaiced with bilinear or ppg (patterned pixel grouping) on --threads
+--planar         write the demosaiced RGB as three planes instead of interleaved
+--bayer <p>      color filter pattern of the top left photosites, RGGB (default), GRBG, GBRG or BGGR
+--format <f>     write 16 bit PGM/PPM (pnm) or TIFF (tiff) instead of the raw dump (dat), by default from the extension of <output>
+--batch          <input> is a directory or a list of CR2 files and <output> a directory, every file is decoded with --photosites
+--frame-stats <file>  with --photosites or --batch, write per Bayer channel histograms, min, max, mean, variance and
+                 clipped counts of the active area and the masked border as one JSON line per file to <file>
+--stats <level>  write stage times (1) and counters (2) of the decode as JSON to stdout or to --stats-file <file>
+--synth          write a synthetic CR2 file to <input> and the photosites it encodes to <output>, see --synth-size WxH,
+                 --synth-slices count,width,last, --synth-noise <amplitude>, --synth-seed <n>, --synth-tables <0|1 x4>
+                 and --synth-sraw 422|420 for an sRAW file, whose <output> is then the RGB it decodes to
+--bench          time the decode kernels on <input> and write the results as CSV to <output>, --bench-reps <n> runs each
+--index          <input> is a CR2 file, a directory or a list of them, write one metadata record per file to <output> (.csv or .jsonl)
+--preview        write the embedded previews to <output>.jpg, <output>.thumb.jpg and <output>.ppm without decoding the raw data
+--threads <n>    number of batch worker threads, one per core by default
+--max-inflight-mb <mb>  bound on the buffers of the files being decoded in a batch, 2048 by default
+--read-ahead <n>        number of batch files a reader thread reads ahead of the workers, 4 by default, 0 to read on the workers
+--read-ahead-mb <mb>    bound on the bytes read ahead, 512 by default
+--scan-threads <n>      with --photosites, split the entropy decoding of the scan over <n> threads
+--scan-sweep            with --photosites, time the split decoding for 1 to <n> threads against the sequential decoding
+--roi x,y,w,h           decode only a region of the frame, from the checkpoints of the sidecar index <input>.idx (built by the
+                        first such decode, every --checkpoint-lines <n> scan lines) on --threads
+--bin <f>               write a preview at 1/<f> scale (2, 4, 8), every pixel the mean of a <f>x<f> block of photosites per
+                        Bayer color, binned as the scan lines are decoded; --bin-gray for one gray value per block
+
 The output is a file containing raw difference values from which you can continue to construct an image by simply summing the difference values. 
 Resetting at the start of every new row.
 
@@ -34,6 +69,31 @@ If you don't want color, you can simply do accumulation of the difference values
 #include <stdio.h>  // fopen, fclose, fread, fseek
 #include <stdlib.h>  // malloc, free
 #include <stdint.h> // uint8_t, uint16_t, uint32_t
+#include <string.h> // strcmp, memcpy, memset
+#include <time.h>   // clock_gettime
+#include <sys/mman.h> // mmap, madvise
+#include <sys/stat.h> // fstat, stat
+#include <dirent.h>   // opendir, readdir
+#include <strings.h>  // strcasecmp
+#include <fcntl.h>    // open
+#include <unistd.h>   // write, close
+#include <errno.h>    // errno, EINTR
+
+#include <string>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 // ==================================================================================================================================================================================================
 // TIFF TAG ENUM
@@ -98,69 +158,191 @@ typedef struct TIFF_TAG {
     uint32_t value;
 } TIFF_TAG; 
 
-// THE FOLLOWING ARE RAW IFD HEADERS AND THEIR ENDIANNESS IS DIFFERENT
+// THE RAW HEADERS (DHT, SOF3, SOS) ARE BIG ENDIAN
 uint16_t swapBytes(uint16_t input) { return (input << 8) | (input >> 8); }
 
-typedef struct DHT_HEADER 
-{
-    uint16_t marker, length;
-    uint8_t  tc_index0;
-    uint8_t  huff_data_0[16];
-    uint8_t  huff_vals_0[15];
-    uint8_t  tc_index1;
-    uint8_t  huff_data_1[16];
-    uint8_t  huff_vals_1[15];
-    void swap() { marker = swapBytes(marker); 
-                  length = swapBytes(length); }
-} DHT_HEADER;
-
-typedef struct SOF3_HEADER {
-    uint16_t marker, length; 
-    uint8_t  sampleP;
-    uint16_t num_lines, samp_per_lin;
-    uint8_t  comp_per_frame;
-    uint8_t  sFactors[12];
-    void swap() { marker       = swapBytes(marker);
-                  length       = swapBytes(length);
-                  num_lines    = swapBytes(num_lines);
-                  samp_per_lin = swapBytes(samp_per_lin); }
-} SOF3_HEADER;
-
-typedef struct SOS_HEADER {
-    uint16_t marker, length; // 
-    uint8_t  numComp;
-    uint8_t  scanCompSel[8];
-    uint8_t  remBytes[3];
-    void swap() { marker = swapBytes(marker);
-                  length = swapBytes(length); }
-} SOS_HEADER;
-
 #pragma pack(pop)
 
+// ==================================================================================================================================================================================================
+// Structs : Stats, timing and counters of a single file decode
+// ==================================================================================================================================================================================================
+
+enum STATS_STAGE { STAGE_HEADERS, STAGE_SCAN_LOAD, STAGE_ENTROPY, STAGE_CORRECTION, STAGE_UNSLICE, STAGE_INTEGRATE, STAGE_DEMOSAIC, STAGE_CONVERT, STAGE_OUTPUT, NUM_STAGES };
+
+// Only the stage boundaries look at the level, the counters are added once per stage from what the decoders
+// keep anyway, so with level 0 the per sample loops cost exactly what they did without instrumentation.
+struct Stats
+{
+    int level; // 0 off, 1 stage times, 2 stage times and counters
+
+    // The batch workers time their stages at the same time, each from its own start times into the shared totals,
+    // which are the sum over the threads
+    static thread_local double stageStart [NUM_STAGES];
+    std::atomic<long> stageNanos [NUM_STAGES];
+
+    std::atomic<long> scanBytes, symbols, slowPathHits, markers, badCodes;
+    std::atomic<long> allocated, peakAllocated; // The large buffers only: scan, unstuffed scan and frames
+
+    Stats() : level(0), scanBytes(0), symbols(0), slowPathHits(0), markers(0), badCodes(0), allocated(0), peakAllocated(0) 
+    {
+        for (int i = 0; i < NUM_STAGES; i++)
+            stageNanos[i] = 0;
+    };
+
+    void start(int stage);
+    void stop(int stage);
+    void count(std::atomic<long> & counter, long n) { if (level > 1) counter += n; }
+    void alloc(long bytes);
+    void release(long bytes) { if (level > 1) allocated -= bytes; }
+    bool write(const char * fname, const char * input);
+};
+
+Stats stats;
+thread_local double Stats::stageStart [NUM_STAGES];
+
+// ==================================================================================================================================================================================================
+// Structs : per decode arena
+// ==================================================================================================================================================================================================
+
+#define ARENA_ALIGN 64
+
+// Bump allocator for the buffers of one decode. They are carved out of a single block reserved up front and all freed
+// with it, so there are no new[] and delete[] to pair up per buffer. Pages that are never written are never resident.
+struct Arena
+{
+    uint8_t * block;
+    uint8_t * base; // block rounded up to ARENA_ALIGN
+    long size, used, peak;
+
+    Arena() : block(NULL), base(NULL), size(0), used(0), peak(0) {};
+    ~Arena() { release(); }
+
+    bool reserve(long bytes);
+    void release();
+
+    template <typename T>
+    T * alloc(long count)
+    {
+        long bytes = (count*sizeof(T) + ARENA_ALIGN - 1) & ~long(ARENA_ALIGN - 1);
+        if (used + bytes > size)
+        {
+            printf("Error in Arena::alloc(): %ld bytes do not fit in the %ld left\n", bytes, size - used);
+            return NULL;
+        }
+        T * p = (T *) (base + used);
+        used += bytes;
+        peak  = used > peak ? used : peak;
+        return p;
+    }
+};
+
 // ==================================================================================================================================================================================================
 // Structs : ByteStream and ImData
 // ==================================================================================================================================================================================================
 
+// Input file that is either read with stdio or mapped into memory once, the headers are parsed through it
+struct InputFile
+{
+    FILE * file;
+    const uint8_t * map;
+    long size;
+    long pos;
+    bool ownsMap; // False when map is a buffer of the caller
+
+    InputFile() : file(NULL), map(NULL), size(0), pos(0), ownsMap(false) {};
+
+    bool open(const char * fname, bool useMmap);
+    void open(const uint8_t * data, long dataSize);
+    void close();
+    void seek(long offset);
+    long tell();
+    long read(void * dst, long elSize, long count);
+};
+
 struct ByteStream
 {
-    uint8_t * bytes;
+    const uint8_t * bytes;
     long size;
     long byteLoc;
+    bool ownsBytes; // False when bytes points into a mapped InputFile
+    long markers;   // Number of 0xFF bytes not followed by a stuffed zero
 
     uint32_t bitBuffer;
     int bitStart;
 
     // Initialize bitStart to 32 so that the bitBuffer is "initialized" as entirely empty
-    ByteStream() : size(0), byteLoc(0), bitStart(32), bitBuffer(0) {};
+    ByteStream() : bytes(NULL), size(0), byteLoc(0), ownsBytes(false), markers(0), bitBuffer(0), bitStart(32) {};
 
     void loadBytes(FILE * fp, long s);
+    void mapBytes(const uint8_t * data, long s);
+    void release();
     uint16_t readBits(int N);
     void print(int N);
 };
 
+// Bit reader over scan data that has had its stuffed zero bytes removed. The bits are kept left aligned
+// in a 64 bit reservoir which is refilled eight bytes at a time without branches.
+struct BitPump
+{
+    uint8_t * bytes; // Unstuffed scan data followed by BIT_PUMP_PADDING zero bytes
+    long size;
+    long capacity;   // Bytes allocated, kept by load() for the next scan when it fits
+    long byteLoc;
+    long markers;    // Number of 0xFF bytes not followed by a stuffed zero
+
+    bool ownsBytes;  // False for a view on the bytes of another BitPump
+
+    uint64_t bitBuffer;
+    int bitCount;
+
+    // The part of the scan that stream() has not unstuffed yet, read from the mapping or the file by topUp()
+    const uint8_t * streamMap;
+    FILE * streamFile;
+    long streamLeft;
+    long streamCarry; // A 0xFF at the end of the last chunk, unstuffed with the byte after it
+    uint8_t * streamChunk;
+    bool streamSimd;
+
+    BitPump() : bytes(NULL), size(0), capacity(0), byteLoc(0), markers(0), ownsBytes(false), bitBuffer(0), bitCount(0), 
+                streamMap(NULL), streamFile(NULL), streamLeft(0), streamCarry(0), streamChunk(NULL), streamSimd(true) {};
+    ~BitPump() { release(); }
+
+    void load(const uint8_t * stuffed, long stuffedSize, bool simd);
+    void load(FILE * fp, long stuffedSize, bool simd);
+    void stream(const uint8_t * map, FILE * fp, long stuffedSize, bool simd);
+    void topUp();
+    void reserve(long stuffedSize);
+    void finishLoad(long unstuffedSize);
+    void view(const BitPump & other);
+    void release();
+    void seekBits(long bitPos);
+
+    long bitPosition() { return byteLoc*8 - bitCount; }
+
+    void refill()
+    {
+        uint64_t word;
+        memcpy(&word, bytes + byteLoc, 8);
+        bitBuffer |= __builtin_bswap64(word) >> bitCount;
+        byteLoc   += (63 - bitCount) >> 3;
+        byteLoc    = byteLoc < size ? byteLoc : size; // Past the end only the zero padding is read
+        bitCount  |= 56;
+    }
+    uint32_t peekBits(int N) { return uint32_t(bitBuffer >> (64 - N)); }
+    void skipBits(int N)     { bitBuffer <<= N; bitCount -= N; }
+    uint32_t readBits(int N) { uint32_t bits = peekBits(N); skipBits(N); return bits; }
+};
+
+#define BIT_PUMP_PADDING 16
+// Bytes of the scan read at a time by BitPump::load(FILE *)
+#define UNSTUFF_CHUNK (1 << 20)
+
+// Values of a DHT table of lossless JPEG, the difference classes 0 to 16
+#define HUFF_MAX_VALUES 17
+
 struct ImData
 {
-    FILE * file;
+    InputFile * input;
 
     TIFF_HEADER tiff_header;
     CR2_HEADER  cr2_header;
@@ -169,756 +351,5539 @@ struct ImData
     
     uint16_t cr2_slice [3];
 
+    int precision, num_lines, samples_per_line, num_comp; // From SOF3, a scan line holds samples_per_line*num_comp samples
+
     long raw_offset, raw_size, raw_dht_offset, raw_sof3_offset, raw_sos_offset, raw_scan_offset, raw_scan_size;
     long exif_subdir_offset, makernote_offset;
 
-    uint8_t huffData [16];
-    int huffValues [16];
+    char make [32], model [64];                // From IFD#0
+    uint32_t exposure_time [2], f_number [2]; // Rationals from the EXIF subdir
+
+    uint8_t huffData [16];   // DHT table 0
+    int huffValues [HUFF_MAX_VALUES];
+    uint8_t huffData1 [16];  // DHT table 1
+    int huffValues1 [HUFF_MAX_VALUES];
+    uint8_t compTable [4];   // From SOS, the DHT table of every component of a scan line
+
+    // sRAW and mRAW: YCbCr with the luma sampled lumaH x lumaV times per chroma sample, 2x1 (4:2:2) or 2x2 (4:2:0).
+    // The image is sraw_width x sraw_height pixels, both 0 for a Bayer raw.
+    int lumaH, lumaV;
+    int sraw_width, sraw_height;
 };
 
-// ==================================================================================================================================================================================================
-// MISC FUNCTIONS (TIDY UP)
-// ==================================================================================================================================================================================================
+// Number of bits resolved by a single lookup in HuffTable, codes longer than this take the slow path
+#define HUFF_LOOKAHEAD 10
 
-void toFile(const char * fname, unsigned char * data, int width, int height);
+struct HuffTable
+{
+    uint16_t lookup [1 << HUFF_LOOKAHEAD]; // (codeLen << 8) | codeValue, 0 when the code is longer than HUFF_LOOKAHEAD
+    int32_t  maxCode [17];                 // Largest code of each length, -1 if there is none
+    uint16_t minCode [17];                 // Smallest code of each length
+    int      valPtr  [17];                 // Index in values of the smallest code of each length
+    uint8_t  values  [HUFF_MAX_VALUES];
 
-template <typename T>
-void getMinMax(T* , T* , T* , int, int);
+    int minLen, maxLen, numCodes;
+    long slowPathHits; // Codes resolved by the slow path, only touched when the lookup misses
 
-template <typename T>
-void freadVar(T*, FILE*);
+    void build(uint8_t * huffData, int * huffValues);
+    bool decode(uint16_t window, int windowLen, int & codeLen, int & codeValue);
+};
 
-void printFatLine();
-void printThinLine();
-void printTiffTag(TIFF_TAG tiff_tag, FILE * fp);
-void printTagInfo(TIFF_TAG tag);
-void printTagType(TIFF_TAG tag);
-void printPointerDataTag(TIFF_TAG tag, FILE * f);
-void printSensorDescriptor(int val);
-void huffCodes(uint8_t * huffData, uint16_t * table);
-void printBits(uint16_t integer);
-void printBits(uint8_t integer);
-void getDiffValues(int * diffOut, ImData im);
+struct DecodeOptions
+{
+    int  bin;             // Photosites per side of the blocks averaged by the binned preview decode, 0 for none
+    bool binGray;         // One gray value per block instead of RGB
+    int  roi [4];         // x, y, width and height of the region to decode with the checkpoint index, width 0 for the whole frame
+    int  checkpointLines; // Scan lines between the checkpoints of a new index
+    int  format;        // IMAGE_FORMAT of the output, -1 to go by the extension of the output file name
+    int  demosaic;      // DEMOSAIC_METHOD applied to the photosites
+    bool planar;        // Demosaiced output as three planes instead of interleaved RGB
+    int  bayerX, bayerY; // Position of the red photosite in the top left 2x2 block
+    bool synth;         // Write a synthetic CR2 file and the photosites it encodes instead of decoding, see SynthParams
+    bool bench;         // Time the decode kernels on the input file
+    int  benchReps;     // Repetitions per kernel, the fastest is reported
+    bool quiet;         // No diagnostic output from getDiffValues
+    const char * statsFile; // Where the --stats JSON goes, stdout when NULL
+    bool index;         // Only parse the headers of the input files and write one metadata record per file
+    bool preview;       // Only extract the embedded JPEG preview, thumbnail and RGB image, the raw scan is not read
+    int  scanThreads;   // Split the entropy decoding of one scan over this many threads, see decodeFrameParallel
+    bool scanSweep;     // Time the parallel decoding for 1 to scanThreads threads and compare it to the sequential decoding
+    bool batch;         // The input is a directory or a list of CR2 files and the output a directory
+    int  threads;       // Batch worker threads, 0 for one per core
+    long maxInflightMB; // Batch memory bound for the frame and scan buffers of the files being decoded
+    int  readAhead;     // Batch files read ahead of the workers by the reader thread, 0 for none
+    long readAheadMB;   // Bound on the bytes of the files read ahead
+    bool photosites; // Apply the predictor while decoding and write 16 bit sensor values instead of difference values
+    int  bandRows;   // Decode in bands of this many rows through a BandConsumer chain instead of full frames, 0 for full frames
+    bool huffSearch; // Use the original linear code search instead of HuffTable, for bit for bit comparisons
+    bool legacyBits; // Read the scan through ByteStream instead of BitPump
+    bool simd;       // Use SSE2 to find the stuffed bytes when loading a BitPump
+    bool mmap;       // Map the input file instead of reading it with fread
+    int  seamCorrect; // Seam correction of the difference values: 1 always, 0 never, -1 for the models in seamModels
+    const char * frameStatsFile; // JSON lines of the FrameStats of every decoded file, NULL for none
+
+    DecodeOptions() : bin(0), binGray(false), checkpointLines(64), format(-1), demosaic(0), planar(false), bayerX(0), bayerY(0), synth(false), bench(false), benchReps(5), quiet(false), statsFile(NULL), index(false), preview(false), scanThreads(1), scanSweep(false), batch(false), threads(0), maxInflightMB(2048), readAhead(4), readAheadMB(512), photosites(false), bandRows(0), huffSearch(false), legacyBits(false), simd(true), mmap(false), seamCorrect(-1), frameStatsFile(NULL)
+    {
+        roi[0] = roi[1] = roi[2] = roi[3] = 0;
+    };
+};
 
-int elementSizeTag(TIFF_TAG tag);
-int dataSizeTag(TIFF_TAG tag);
 int getDiffValue(uint16_t code, int len);
 
-unsigned char toUChar(int dVal, int maxAbs);
-
-int main(int argc, char * argv[])
+// Camera model whose difference values have a defect at the start of some scan rows. The first 4 samples of rows
+// firstRow, firstRow + rowStep, ... are replaced by getDiffValues with a cubic through the same colour samples on
+// either side of them.
+struct SeamModel
 {
+    const char * model; // As in the MODEL tag of IFD#0
+    int firstRow;
+    int rowStep;
+};
 
-    // Check that input is proper
-    if (argc != 3) 
-    {
-        printf("\nThis application takes two arguments:\n\nmain.a <input> <output>\n\n");
-        return 0;
-    }
+struct ImageWriter;
+struct FrameStats;
 
-    FILE *fp = fopen(argv[1], "rb");
-    char* out_fname = argv[2];
+// Decoder state at the start of a scan line: where its first code starts and the predictor seeds
+struct ScanCheckpoint
+{
+    long bitPos;        // In the unstuffed scan
+    long stuffedOffset; // Byte of the stuffed scan, from its start, that holds the bit at bitPos
+    int  bit;           // Bit of that byte, 0 is the most significant
+    uint16_t seeds [4]; // lineStart of the ScanDecoder
+};
 
-    if ( fp == NULL )
+// Entropy decoder that can be resumed, it hands out the difference values of the scan a run of samples at a time
+struct ScanDecoder
+{
+    BitPump pump;
+    HuffTable huffTable;  // DHT table 0
+    HuffTable huffTable1; // DHT table 1, only built when a component uses it
+    int maxLen, maxLen1;
+    long samplesDone;
+    long badCodes; // Number of times no code matched the stream
+
+    ScanDecoder() : maxLen(0), maxLen1(0), samplesDone(0), badCodes(0), tableBuilt(false), singleTable(true), numComp(1), lineWidth(0), 
+                    runKernel(&ScanDecoder::decodeRun<1>), diffKernel(&ScanDecoder::decodeDiffs<1>), mcuKernel(NULL), checkpoints(NULL), checkpointLines(0) {};
+
+    // The DHT the tables were built from, begin() keeps them when the next scan has the same ones
+    bool tableBuilt;
+    uint8_t tableData [2][16];
+    int tableValues [2][HUFF_MAX_VALUES];
+
+    // DHT table of every component, all 0 and singleTable set when the components decode with the same codes
+    uint8_t compTable [4];
+    bool singleTable;
+
+    // Predictor state for decodeLines(), the first sample of each component on the previous line
+    int numComp, lineWidth;
+    uint16_t lineStart [4];
+
+    // decodeRun() and decodeDiffs() for numComp, picked by setup()
+    void (ScanDecoder::*runKernel)(uint16_t * dst, int n, uint16_t * pred);
+    void (ScanDecoder::*diffKernel)(int * out, long count);
+    // decodeMcuRun() for the luma sampling of an sRAW/mRAW file
+    void (ScanDecoder::*mcuKernel)(uint16_t * luma, long lumaStride, uint16_t * cb, uint16_t * cr, int n, uint16_t * pred);
+
+    // When set, decodeLines() and decodeFrame() add a checkpoint at every checkpointLines-th scan line
+    std::vector<ScanCheckpoint> * checkpoints;
+    int checkpointLines;
+
+    void setup(ImData & im);
+    void begin(ImData & im, DecodeOptions opts);
+    void beginStream(ImData & im, DecodeOptions opts);
+    void share(const ScanDecoder & other);
+    void decode(int * out, long count);
+    void decodeLines(uint16_t * out, int numLines);
+    void decodeFrame(uint16_t * frame, ImData & im, ImageWriter * writer);
+    void decodeSraw(ImData & im, uint16_t * luma, uint16_t * cb, uint16_t * cr);
+
+    void checkpoint(long line)
     {
-        printf("The file \"%s\" cannot be located or successfully opened!", argv[1]);
-        return 0;
+        if (line % checkpointLines)
+            return;
+        ScanCheckpoint cp;
+        cp.bitPos = pump.bitPosition();
+        cp.stuffedOffset = 0;
+        cp.bit = 0;
+        memcpy(cp.seeds, lineStart, sizeof(cp.seeds));
+        checkpoints->push_back(cp);
     }
 
-    
-    ImData imageData;
-    imageData.file = fp;
+    int decodeDiff() { return decodeDiff(huffTable, maxLen); }
 
-    // ==================================================================================================================================================================================================
-    // READING FILE HEADERS
-    // ==================================================================================================================================================================================================
+    int decodeDiff(HuffTable & table, int tableMaxLen)
+    {
+        // One refill leaves at least 56 bits, enough for a code and its difference bits
+        pump.refill();
 
-    // =====================================================================
-    // TIFF AND CR2 HEADERS
-    // =====================================================================
+        int codeLen, codeValue;
+        if (!table.decode(pump.peekBits(tableMaxLen), tableMaxLen, codeLen, codeValue))
+        {
+            badCodes++;
+            codeLen   = tableMaxLen;
+            codeValue = 0;
+        }
+        pump.skipBits(codeLen);
 
-    printFatLine();
-    freadVar(&imageData.tiff_header, fp);
-    freadVar(&imageData.cr2_header, fp);
-    printFatLine();
-    
-    // =====================================================================
-    // IFD #0
-    // =====================================================================
-   
-    printf("IFD#0 :");
-    printFatLine();
+        // Classes 0 and 16 are the differences 0 and 32768 with no extra bits
+        if (codeValue == 0 || codeValue == 16)
+            return getDiffValue(0, codeValue);
+        return getDiffValue(pump.readBits(codeValue), codeValue);
+    }
 
-    uint16_t num_IFD_entries;
-    freadVar(&num_IFD_entries, fp);
-       
-       TIFF_TAG tiff_tag;
-    for (int i = 0; i < num_IFD_entries; i++)    
+    // Predictor 1 over a run of n samples of N interleaved components, n a multiple of N. The table and the prediction
+    // of every component are locals of the unrolled loop, so there is no branch on the component per sample.
+    template <int N> void decodeRun(uint16_t * dst, int n, uint16_t * pred)
     {
-        printf("Entry number %d ", i);
-        freadVar(&tiff_tag, fp);
-        if (tiff_tag.ID == EXIF)
+        HuffTable * tables [N];
+        int lens [N];
+        uint16_t p [N];
+        for (int c = 0; c < N; c++)
+        {
+            tables[c] = compTable[c] ? &huffTable1 : &huffTable;
+            lens[c]   = compTable[c] ? maxLen1 : maxLen;
+            p[c]      = pred[c];
+        }
+        for (int i = 0; i < n; i += N)
         {
-            imageData.exif_subdir_offset = tiff_tag.value;
+            for (int c = 0; c < N; c++)
+            {
+                p[c] += decodeDiff(*tables[c], lens[c]);
+                dst[i + c] = p[c];
+            }
         }
-        printTiffTag(tiff_tag, fp);
+        for (int c = 0; c < N; c++)
+            pred[c] = p[c];
     }
-    printFatLine();
-
-    // =====================================================================
-    // EXIF SUBDIR (of TIFF)
-    // =====================================================================
 
-    printf("EXIF SUBDIR:");
-    printFatLine();
-    fseek(fp, imageData.exif_subdir_offset, SEEK_SET);
-    freadVar(&num_IFD_entries, fp);
-    for (int i = 0; i < num_IFD_entries; i++)    
+    // A run of n sRAW/mRAW MCUs, each H x V luma samples then Cb and Cr. As in dcraw, every luma sample predicts from the
+    // luma sample decoded before it and the chroma from the MCU before; pred holds the three predictions.
+    template <int H, int V> void decodeMcuRun(uint16_t * luma, long lumaStride, uint16_t * cb, uint16_t * cr, int n, uint16_t * pred)
     {
-        freadVar(&tiff_tag, fp);
-        if (tiff_tag.ID == MAKERNOTE)
+        HuffTable & tableY  = compTable[0] ? huffTable1 : huffTable;
+        HuffTable & tableCb = compTable[1] ? huffTable1 : huffTable;
+        HuffTable & tableCr = compTable[2] ? huffTable1 : huffTable;
+        int lenY  = compTable[0] ? maxLen1 : maxLen;
+        int lenCb = compTable[1] ? maxLen1 : maxLen;
+        int lenCr = compTable[2] ? maxLen1 : maxLen;
+        uint16_t y = pred[0], b = pred[1], r = pred[2];
+        for (int m = 0; m < n; m++)
         {
-            imageData.makernote_offset = tiff_tag.value;
+            for (int v = 0; v < V; v++)
+            {
+                for (int h = 0; h < H; h++)
+                {
+                    y += decodeDiff(tableY, lenY);
+                    luma[v*lumaStride + H*m + h] = y;
+                }
+            }
+            b += decodeDiff(tableCb, lenCb);
+            r += decodeDiff(tableCr, lenCr);
+            cb[m] = b;
+            cr[m] = r;
         }
-        printTiffTag(tiff_tag, fp);
+        pred[0] = y;
+        pred[1] = b;
+        pred[2] = r;
     }
-    printf("\n");
-    printFatLine();
-
-    // =====================================================================
-    // Makernote
-    // =====================================================================
-
-       printf("Makernote: (displaying sensor data only)");
-       printFatLine();
-       fseek(fp, imageData.makernote_offset, SEEK_SET);
-       freadVar(&num_IFD_entries, fp);
-
-       for (int i = 0; i < num_IFD_entries; i++)
-       {
-           freadVar(&tiff_tag, fp);
-           if (tiff_tag.ID == SENSOR_INFO)
-           {
-               fseek(fp, tiff_tag.value, SEEK_SET);
-               uint16_t numEntries;
-               freadVar(&numEntries, fp);
-               printf("\n");
-               for( int j = 0; j < 8; j++)
-               {
-                   uint16_t entryVal;
-                   freadVar(&entryVal, fp);
-                   printSensorDescriptor(j);
-                   printf(" = %d\n", entryVal);
-
-                   if (j == 0)
-                       imageData.sensor_width = entryVal;
-                   if (j == 1)
-                       imageData.sensor_height = entryVal;
-                   if (j == 4)
-                       imageData.sensor_left_border = entryVal;
-                   if (j == 5)
-                       imageData.sensor_top_border = entryVal;
-                   if (j == 6)
-                       imageData.sensor_right_border = entryVal;
-                   if (j == 7)
-                       imageData.sensor_bottom_border = entryVal;
-               }
-           }
-       }
-       printFatLine();
-
-    // =====================================================================
-    // RAW IFD 
-    // =====================================================================
-   
-    printf("RAW IFD :");
-    printFatLine();
-    fseek(fp, imageData.cr2_header.offset, SEEK_SET);
-    fread(&num_IFD_entries, sizeof(num_IFD_entries), 1, fp);
-
-    uint16_t cr2slice [3];
 
-    for (int i = 0; i < num_IFD_entries; i++)    
+    // The difference values of the next count samples, which may start at any component
+    template <int N> void decodeDiffs(int * out, long count)
     {
-        printf("Entry number %d ", i);
-        printThinLine();
-        freadVar(&tiff_tag, fp);
-        long currentOffset = ftell(fp);
-
-        if (tiff_tag.ID == STRIP_OFFSET) // Offset of raw
-        {
-            imageData.raw_offset = tiff_tag.value;
-        }
-        if (tiff_tag.ID == STRIP_BYTE_COUNTS) // Size of raw in bytes
+        HuffTable * tables [N];
+        int lens [N];
+        for (int c = 0; c < N; c++)
         {
-            imageData.raw_size = tiff_tag.value;
+            tables[c] = compTable[c] ? &huffTable1 : &huffTable;
+            lens[c]   = compTable[c] ? maxLen1 : maxLen;
         }
-        if (tiff_tag.ID == CR2_SLICE)
+        long i = 0;
+        for (int c = samplesDone % N; c && c < N && i < count; c++, i++)
+            out[i] = decodeDiff(*tables[c], lens[c]);
+        for (; i + N <= count; i += N)
         {
-            fseek(fp, tiff_tag.value, SEEK_SET);
-            fread(&cr2slice, sizeof(uint16_t), tiff_tag.values, fp);
-            fseek(fp, currentOffset, SEEK_SET);
-            fseek(fp, tiff_tag.value, SEEK_SET);
-            fread(&imageData.cr2_slice, sizeof(uint16_t), tiff_tag.values, fp);
-            fseek(fp, currentOffset, SEEK_SET);
+            for (int c = 0; c < N; c++)
+                out[i + c] = decodeDiff(*tables[c], lens[c]);
         }
-
-        printTiffTag(tiff_tag, fp);
+        for (int c = 0; i < count; c++, i++)
+            out[i] = decodeDiff(*tables[c], lens[c]);
     }
-    printFatLine();
-    // =====================================================================
+};
 
-    // =====================================================================
-    // RAW FILE HEADERS
-    // =====================================================================
+// ==================================================================================================================================================================================================
+// Structs : reusable decoder
+// ==================================================================================================================================================================================================
 
-    fseek(fp, imageData.raw_offset, SEEK_SET);
+// Decodes one CR2 file after another into photosite buffers of the caller. The file bytes, the unstuffed scan, the Huffman
+// table and the scan order buffer of files whose slices split a group of components are kept from one file to the next and
+// only ever grow, so once they fit the largest file the sequential decode allocates nothing.
+struct Cr2Decoder
+{
+    DecodeOptions opts;
+    InputFile input;
+    ImData im;
+    ScanDecoder scan;
+
+    uint8_t * fileBytes;   // The file read by open(fname)
+    long fileCapacity;
+    uint16_t * scanValues; // Scan order samples when the slices are not aligned
+    long scanCapacity;
+    uint16_t * planes;     // Luma and chroma planes of an sRAW/mRAW file
+    long planesCapacity;
+
+    Cr2Decoder() : fileBytes(NULL), fileCapacity(0), scanValues(NULL), scanCapacity(0), planes(NULL), planesCapacity(0) {};
+    ~Cr2Decoder();
+
+    bool open(const char * fname);
+    bool open(const uint8_t * data, long size);
+    void close();
+    long decode(uint16_t * photosites, ImageWriter * writer);
+    long decodeSraw(uint16_t * rgb, ImageWriter * writer, int numThreads);
+
+    int width()  { return im.sraw_width ? im.sraw_width : im.sensor_width; }
+    int height() { return im.sraw_height ? im.sraw_height : im.sensor_height; }
+};
 
-    uint16_t soi_marker;
-    freadVar(&soi_marker, fp);
-    printf("SOI_MARKER = %04x\n", swapBytes(soi_marker));
+// ==================================================================================================================================================================================================
+// Structs : synthetic CR2 files
+// ==================================================================================================================================================================================================
 
-    // =====================================================================
-    // DHT HEADER
-    // =====================================================================
-   
-    printf("\n\nDHT_HEADER\n\n");
+// Layout and image statistics of a generated file. The photosites are a diagonal ramp plus a per Bayer
+// channel offset plus uniform noise, so noise sets the spread of the differences and with it the code lengths.
+struct SynthParams
+{
+    int width, height;
+    uint16_t slices [3];  // CR2_SLICE, [count, width, lastWidth]
+    int precision;        // Bits per photosite, at most 14 so that 15 Huffman values cover every difference
+    int noise;            // Amplitude of the uniform noise
+    int ramp;             // Period of the diagonal ramp
+    uint32_t seed;
+    uint8_t tables [4];   // DHT table of each component, those on table 1 get 4 times the noise and a table of their own
+    int lumaV;            // sRAW instead of a Bayer raw, 1 for 4:2:2 and 2 for 4:2:0, see writeSynthCr2()
+
+    SynthParams() : width(5184), height(3456), precision(14), noise(40), ramp(3000), seed(1), lumaV(0)
+    {
+        slices[0] = 2;
+        slices[1] = 1728;
+        slices[2] = 1728;
+        tables[0] = tables[1] = tables[2] = tables[3] = 0;
+    };
+};
 
-    DHT_HEADER dht_header;
-    fread(&dht_header, sizeof(dht_header), 1, fp);
-    dht_header.swap();
+// ==================================================================================================================================================================================================
+// Structs : demosaicing
+// ==================================================================================================================================================================================================
 
-    for (int i = 0; i < 16; i++)
-    {
-        imageData.huffData[i]   = dht_header.huff_data_0[i];
-        imageData.huffValues[i] = dht_header.huff_vals_0[i];
-    }
+enum DEMOSAIC_METHOD { DEMOSAIC_NONE, DEMOSAIC_BILINEAR, DEMOSAIC_PPG };
 
-    printf("%6s = %04x\n", "Marker", dht_header.marker);
-    printf("%6s = %d\n"  , "Length", dht_header.length);
+// Rows per tile, with the halo rows a tile of a 6000 pixel wide frame stays within a typical L2 cache
+#define DEMOSAIC_TILE_ROWS 32
+// Rows and columns around a tile that the patterned pixel grouping reads
+#define DEMOSAIC_HALO 3
 
-    // =====================================================================
-    // SOF3 HEADER
-    // =====================================================================
+// A frame being demosaiced, the workers take tiles of DEMOSAIC_TILE_ROWS rows in turn
+struct DemosaicJob
+{
+    const uint16_t * mosaic;
+    uint16_t * rgb;
+    int width, height;
+    int method;
+    bool planar;
+    int bayerX, bayerY;
+    int maxValue;
+
+    std::atomic<int> nextTile;
+
+    DemosaicJob() : mosaic(NULL), rgb(NULL), width(0), height(0), method(DEMOSAIC_BILINEAR), planar(false), 
+                    bayerX(0), bayerY(0), maxValue(65535), nextTile(0) {};
+};
 
-    printf("\n\nSOF3_HEADER\n\n");    
-     
-    int currentOffset = ftell(fp);
+// ==================================================================================================================================================================================================
+// Structs : sRAW and mRAW
+// ==================================================================================================================================================================================================
 
-    SOF3_HEADER sof3_header;
-    fread(&sof3_header, sizeof(sof3_header), 1, fp);
-    sof3_header.swap();
+// Rows converted from YCbCr to RGB at a time by one worker
+#define SRAW_BAND_ROWS 16
 
-    printf("%15s = %04x\n", "Marker", sof3_header.marker);
-    printf("%15s = %04x\n", "Length", sof3_header.length);
-    printf("%15s = %d\n"  , "SampleP", sof3_header.sampleP);
-    printf("%15s = %d\n"  , "Num Lines", sof3_header.num_lines);
-    printf("%15s = %d\n"  , "Samp per line", sof3_header.samp_per_lin);
-    printf("%15s = %d\n"  , "# comp per frame", sof3_header.comp_per_frame);
-    printf("\n");
+// An sRAW/mRAW image being converted to RGB, the workers take bands of SRAW_BAND_ROWS rows in turn
+struct SrawJob
+{
+    const uint16_t * luma, * cb, * cr;
+    uint16_t * rgb;
+    int width, height, lumaV;
 
-    for (int i = 0; i < 4; i++)
-    {
-        for (int j = 0; j < 3; j++)
-        {
-            printf("%02x", sof3_header.sFactors[j + 3*i]);
-            if (j != 2)
-                printf(" : ");
-            else
-                printf("\n");
-        }
-    }
+    std::atomic<int> nextBand;
 
-     int num_lines = sof3_header.num_lines;
-     int samplesPerLine = sof3_header.samp_per_lin;
+    SrawJob() : luma(NULL), cb(NULL), cr(NULL), rgb(NULL), width(0), height(0), lumaV(1), nextBand(0) {};
+};
 
-    // =====================================================================
-    // SOS HEADER
-    // =====================================================================
+// ==================================================================================================================================================================================================
+// Structs : 16 bit image writers
+// ==================================================================================================================================================================================================
 
-     printf("\n\n\n");
-     printf("SOS_HEADER\n\n");
-    imageData.raw_sos_offset = ftell(fp);
+enum IMAGE_FORMAT { FORMAT_DAT, FORMAT_PNM, FORMAT_TIFF };
 
-    SOS_HEADER sos_header;
-    fread(&sos_header, sizeof(sos_header), 1, fp);
-    sos_header.swap();
+// Size of each of the two write buffers, a multiple of the page size they are aligned to
+#define WRITER_BUFFER_SIZE (4 << 20)
+#define WRITER_ALIGN 4096
+// Rows per TIFF strip
+#define TIFF_STRIP_ROWS 16
 
-    printf("%6s = %04x\n", "Marker", sos_header.marker);
-    printf("%6s = %d\n"  , "Length", sos_header.length);
-    printf("%6s = %d\n"  , "# comp", sos_header.numComp);
-    printf("\n");
-    printf("%s", "Scan component selector : \n");
-    
-    for (int i = 0; i < 4; i++)
-    {
-        for (int j = 0; j < 2; j++)
-        {
-            if (j != 1)
-                printf("%20s %x"    , " ", sos_header.scanCompSel[j + 2*i]);
-            else
-                printf("%20s %02x\n", " ", sos_header.scanCompSel[j + 2*i]);
-        }
-    }
-    printf("Last three bytes: \n");
-    for (int i = 0; i < 3; i++)
+// Writes a 16 bit gray or RGB image a few rows at a time, as the rows are produced. FORMAT_DAT is the layout of toFile16,
+// two ints for width and height and the samples, FORMAT_PNM a binary PGM/PPM (big endian samples) and FORMAT_TIFF an
+// uncompressed little endian baseline TIFF in strips. The headers only depend on the size of the image, so they go first.
+// Rows are copied into one of two page aligned buffers while the other one is written out by a thread of its own,
+// so the write calls overlap with whatever produces the rows.
+struct ImageWriter
+{
+    int fd;
+    int format, width, height, channels, maxValue;
+    int rowsWritten;
+    bool failed;
+    FrameStats * frameStats; // Gathers the statistics of the rows as they are handed over, NULL for none
+
+    uint8_t * buffers [2];
+    int  current;     // The buffer rows are copied into
+    long fill;        // Bytes in buffers[current]
+    long pendingSize; // Bytes of buffers[current ^ 1] handed to the writer thread, 0 when it is idle
+    bool closing;
+
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable cond;
+
+    ImageWriter() : fd(-1), format(FORMAT_DAT), width(0), height(0), channels(1), maxValue(65535), rowsWritten(0), failed(false), 
+                    frameStats(NULL), current(0), fill(0), pendingSize(0), closing(false)
     {
-        printf("%20s %02x\n", " ", sos_header.remBytes[i]);
-    }
+        buffers[0] = buffers[1] = NULL;
+    };
+    ~ImageWriter() { close(); }
+
+    bool open(const char * fname, int format, int width, int height, int channels, int maxValue);
+    void writeRows(const uint16_t * rows, int numRows);
+    void rowsReady(const uint16_t * image, int numRows);
+    bool close();
+
+    void header();
+    void flush();
+    void writerLoop();
+};
 
-    imageData.raw_scan_offset = ftell(fp);
-    imageData.raw_scan_size = imageData.raw_size - (imageData.raw_scan_offset - imageData.raw_offset);
+// ==================================================================================================================================================================================================
+// Structs : embedded previews
+// ==================================================================================================================================================================================================
 
-    // ==================================================================================================================================================================================================
-    // DECODING SCAN DATA
-    // ==================================================================================================================================================================================================
-    
-    printf("\n\nAttempting to decode from binary to difference values\n");
+// Images that the camera stores next to the raw data, found by following the IFD chain from IFD#0
+struct PreviewInfo
+{
+    long jpeg_offset, jpeg_size;     // IFD#0 strip, the large JPEG preview
+    long thumb_offset, thumb_size;   // IFD#1 JPEG_INTERCHANGE_FORMAT, the small JPEG thumbnail
+    long rgb_offset, rgb_size;       // IFD#2 strip, uncompressed RGB
+    int  rgb_width, rgb_height, rgb_bits;
 
-    int numDiffValues = imageData.sensor_width*imageData.sensor_height;
-    int * diffValueList = new int [numDiffValues];
+    PreviewInfo() : jpeg_offset(0), jpeg_size(0), thumb_offset(0), thumb_size(0), rgb_offset(0), rgb_size(0), 
+                    rgb_width(0), rgb_height(0), rgb_bits(0) {};
+};
 
-    // Function that decodes binary data to produce difference values (RGGB diff values in this case)
-    getDiffValues(diffValueList, imageData);
+// ==================================================================================================================================================================================================
+// Structs : speculative parallel decoding of a single scan
+// ==================================================================================================================================================================================================
 
-    printf("Decoding complete!\n");
+// Symbol starts kept per chunk to find where its speculative decode meets the true stream
+#define SYNC_WINDOW 4096
 
-    // =====================================================================
-    // Un-slicing difference values
-    // =====================================================================
+// A piece of the unstuffed scan decoded on its own thread. Except for the first chunk, startBit is only a
+// guess at a symbol start, the decode is right from the first of its symbol starts that the true stream also hits.
+struct ScanChunk
+{
+    long startBit, endBit;        // Symbols starting in [startBit, endBit) are decoded
+    long stopBit;                 // Start of the first symbol after the chunk
+    std::vector<int16_t> diffs;   // Difference values modulo 2^16
+    std::vector<long> starts;     // Start of the first SYNC_WINDOW symbols
+    std::vector<long> badAt;      // Index in diffs of every symbol whose code was not found
+};
 
-    // RG RG RG RG RG RG RG RG RG RG RG ...
-    // GB GB GB GB GB GB GB GB GB GB GB ...
+struct ParallelTiming
+{
+    double firstRow, lastRow;     // Seconds from the start of decoding
+    long resyncSymbols;           // Symbols decoded sequentially while stitching, 0 if every chunk was in sync at its boundary
+};
 
-    // ==============================================================================
-    // Cropped slices
-    // ==============================================================================
+// ==================================================================================================================================================================================================
+// Structs : checkpoint index for region decoding
+// ==================================================================================================================================================================================================
 
-    int maxInt, minInt, maxAbs;
-    minInt = -1046;
-    maxInt =  1210;
-    maxAbs = abs(maxInt) < abs(minInt) ? abs(minInt) : abs(maxInt) ;
+#define SCAN_INDEX_MAGIC "CR2IDX2"
 
+// Sidecar index <input>.idx of a CR2 file, a ScanCheckpoint every lines scan lines. Decoding from a checkpoint needs only
+// the stuffed scan from its byte on, so a region of the frame costs the scan lines of its checkpoint intervals.
+// The file size and modification time and the place of the scan tell whether the index still belongs to the file.
+struct ScanIndex
+{
+    long fileSize, fileTime, scanOffset, scanSize; // fileTime in ns
+    int lines;
+    std::vector<ScanCheckpoint> checkpoints;
 
+    ScanIndex() : fileSize(0), fileTime(0), scanOffset(0), scanSize(0), lines(0) {};
 
-    int sliceOneLen = cr2slice[1]*imageData.sensor_height;
-    int sliceOneWidth = cr2slice[1];
-    int sliceOneHeight = imageData.sensor_height;
-    unsigned char * sliceOne = new unsigned char [sliceOneLen];
-    for (int i = 0; i < sliceOneLen; i++)
-    {
-        unsigned char tchar = toUChar(diffValueList[i], maxAbs); //(unsigned char) ((diffValueList[i] - minInt)*(255/float(maxInt - minInt)));
-        sliceOne[i] = tchar;
-    }
+    bool read(const char * fname, ImData & im, long inputSize, long inputTime);
+    bool write(const char * fname);
+};
 
-    int sliceTwoLen = cr2slice[1]*imageData.sensor_height;
-    int sliceTwoWidth = cr2slice[1];
-    int sliceTwoHeight = imageData.sensor_height;
-    unsigned char * sliceTwo = new unsigned char [sliceTwoLen];
-    int ctr = 0;
-    for (int i = sliceOneLen; i < (sliceOneLen + sliceTwoLen); i++)
-    {
-        unsigned char tchar = toUChar(diffValueList[i], maxAbs);
-        sliceTwo[ctr++] = tchar;
-    }
+// A region being decoded from an index, the workers take the checkpoint intervals that cover it in turn
+struct RoiJob
+{
+    ImData * im;
+    ScanIndex * index;
+    const uint8_t * scan; // The stuffed scan in the mapped file
+    bool simd;
+    int x, y, width, height;
+    uint16_t * roi;
+
+    std::vector<int> intervals;
+    std::atomic<int> next;
+    std::atomic<long> badCodes;
+
+    RoiJob() : im(NULL), index(NULL), scan(NULL), simd(true), x(0), y(0), width(0), height(0), roi(NULL), next(0), badCodes(0) {};
+};
 
-    int sliceThreeLen = cr2slice[2]*imageData.sensor_height;
-    int sliceThreeWidth = cr2slice[2];
-    int sliceThreeHeight = imageData.sensor_height;
-    unsigned char * sliceThree = new unsigned char [sliceThreeLen];
-    ctr = 0;
-    for (int i = (sliceOneLen + sliceTwoLen); i < (sliceOneLen + sliceTwoLen + sliceThreeLen); i++)
-    {
-        unsigned char tchar = toUChar(diffValueList[i], maxAbs);
-        sliceThree[ctr++] = tchar;
-    }
+// ==================================================================================================================================================================================================
+// Structs : binned preview decode
+// ==================================================================================================================================================================================================
 
-    int RAW_LENGTH = imageData.sensor_width*imageData.sensor_height;
-    int RAW_WIDTH  = imageData.sensor_width;
-    int RAW_HEIGHT = imageData.sensor_height;
-    unsigned char * RAW_DIFF = new unsigned char [RAW_LENGTH];
-    ctr = 0;
-    int ctrOne = 0, ctrTwo = 0, ctrThree = 0;
-    for (int i = 0; i < RAW_HEIGHT; i++)
-    {
-        for (int j = 0; j < RAW_WIDTH; j++)
-        {
-            if (j < sliceOneWidth)
-                RAW_DIFF[ctr++] = sliceOne[ctrOne++];
-            else if (j < 2*sliceOneWidth)
-                RAW_DIFF[ctr++] = sliceTwo[ctrTwo++];
-            else
-                RAW_DIFF[ctr++] = sliceThree[ctrThree++];
-        }
-    }
+// Scales the frame down by factor in both directions as the scan lines come out of the decoder, every output pixel the mean
+// of a factor x factor block of photosites per Bayer color (or of all of them for gray). The scan runs through the slices
+// one after the other, so only the sums of the band of factor slice rows being decoded are kept, for the columns of the
+// current slice. A block cut by the right edge of a slice carries its sums over to the next slice.
+struct Binner
+{
+    ImData * im;
+    int factor, shift, channels;
+    int bayerX, bayerY;
+    int outWidth, outHeight;
+    uint16_t * out;
+    ImageWriter * writer; // Gets the output rows as the last slice finishes them, can be NULL
+
+    uint32_t * band;  // R, G and B sums of every output column of the band
+    uint32_t * carry; // R, G and B sums of the cut block at the right edge of every slice, per output row
+
+    // Place of the next sample in the frame, as in decodeFrame
+    int slice, sliceX0, sliceWidth, row, col;
+    int firstCol, lastCol; // Output columns of the current slice
+
+    Binner() : im(NULL), factor(2), shift(1), channels(3), bayerX(0), bayerY(0), outWidth(0), outHeight(0), out(NULL), writer(NULL), 
+               band(NULL), carry(NULL), slice(0), sliceX0(0), sliceWidth(0), row(0), col(0), firstCol(0), lastCol(-1) {};
+    ~Binner();
+
+    bool begin(ImData & im, int factor, bool gray, int bayerX, int bayerY, ImageWriter * writer);
+    void consume(const uint16_t * samples, long count);
+    void startSlice();
+    void startBand();
+    void finishBand();
+};
 
-    // Cropped Slice
-    int cropTop = 0;
-    int cropLeft = 0;
-    int cropRight = 1728;
-    int cropSliceW = cropRight - cropLeft;
-    // int cropSliceH = sliceOneHeight;
-    int cropSliceH = sliceTwoHeight;
-    int cropSliceLen = cropSliceW*cropSliceH;
+// ==================================================================================================================================================================================================
+// Structs : frame statistics
+// ==================================================================================================================================================================================================
 
-    uchar * cropSliceOne = new uchar [cropSliceLen];
-    ctr = 0;
-    for (int i = 0; i < cropSliceH; i++)
-    {
-        for (int j = cropLeft; j < cropRight; j++ )
+// Histogram bits of FrameStats, a larger precision gets 1 << precision bins, merged down to 14 bits when written
+#define FRAME_STATS_BITS 14
+
+// Per Bayer channel statistics of the photosites, gathered from the rows as the decode hands them to the ImageWriter,
+// while they are still in the cache, so the frame is never read again. Only the histograms are updated per photosite,
+// two copies per channel so that neighbouring photosites of the same value do not wait on each other's increment, and
+// the min, max, mean, variance and clipped count come from them when the record is written. The active area of
+// SENSOR_INFO and the masked border around it are kept apart.
+struct FrameStats
+{
+    int width, height, precision, whiteLevel;
+    int left, top, right, bottom; // Active area, inclusive, the whole frame when SENSOR_INFO has none
+    int bayerX, bayerY;
+    int bins;
+    std::vector<uint32_t> hist;   // [region][copy][channel][bins], region 0 the active area and 1 the border
+
+    FrameStats() : width(0), height(0), precision(0), whiteLevel(0), left(0), top(0), right(0), bottom(0), bayerX(0), bayerY(0), bins(0) {};
+
+    void begin(const ImData & im, const DecodeOptions & opts);
+    void addRows(const uint16_t * rows, int y0, int numRows);
+    void addRun(const uint16_t * row, int x, int end, int region, int rowParity);
+    std::string record(const char * fname) const;
+};
+
+// ==================================================================================================================================================================================================
+// Structs : batch decoding
+// ==================================================================================================================================================================================================
+
+// Bytes of frame and scan buffers that the batch workers may hold at once
+struct InflightBudget
+{
+    std::mutex mutex;
+    std::condition_variable freed;
+    long used, limit;
+
+    InflightBudget() : used(0), limit(0) {};
+
+    void acquire(long bytes);
+    void release(long bytes);
+};
+
+// Header only metadata records of many files, written to one CSV or JSON lines file as the workers finish them
+struct IndexJob
+{
+    DecodeOptions opts;
+    std::vector<std::string> files;
+    FILE * out;
+    bool json;
+    std::mutex outMutex;
+
+    std::atomic<long> next, done, failed;
+
+    IndexJob() : out(NULL), json(false), next(0), done(0), failed(0) {};
+};
+
+// The bytes of one batch file, read ahead of the workers
+struct PrefetchBuffer
+{
+    uint8_t * data;
+    long capacity, size;
+    bool ok;
+
+    PrefetchBuffer() : data(NULL), capacity(0), size(0), ok(false) {};
+};
+
+// Reads the files of a batch in order on its own thread while the workers decode the files before them. At most depth
+// files and maxBytes bytes are read and not yet decoded; a file larger than maxBytes is still read, on its own. The
+// buffers go back to a pool once their file is decoded and only grow, so a batch of similar files allocates depth buffers.
+struct Prefetcher
+{
+    const std::vector<std::string> * files;
+    int depth;
+    long maxBytes;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<PrefetchBuffer*> pool;  // Free buffers
+    std::vector<PrefetchBuffer*> ready; // Per file, the buffer once it is read
+    int  ahead;      // Files read and not given back
+    long aheadBytes;
+    int  peakAhead;  // Most of each held at once
+    long peakAheadBytes;
+    double readTime; // Time the reader spent in open and read
+
+    std::thread reader;
+
+    Prefetcher() : files(NULL), depth(1), maxBytes(0), ahead(0), aheadBytes(0), peakAhead(0), peakAheadBytes(0), readTime(0) {};
+    ~Prefetcher();
+
+    void start(const std::vector<std::string> & files, int depth, long maxBytes);
+    void readerLoop();
+    PrefetchBuffer * take(long file);
+    void give(PrefetchBuffer * buffer);
+};
+
+struct BatchJob
+{
+    DecodeOptions opts;
+    std::vector<std::string> files;
+    std::string outDir;
+    InflightBudget budget;
+    Prefetcher * prefetch;      // NULL when the workers read their files themselves
+    std::vector<double> inputWait; // Per worker, the time spent waiting for or reading input files
+    FILE * statsOut;               // FrameStats records, NULL without --frame-stats
+    std::mutex statsMutex;
+
+    std::atomic<long> next, done, failed, photosites;
+
+    BatchJob() : prefetch(NULL), statsOut(NULL), next(0), done(0), failed(0), photosites(0) {};
+};
+
+// ==================================================================================================================================================================================================
+// Structs : Band and the band consumers of the streaming decode
+// ==================================================================================================================================================================================================
+
+// A band of rows, consumers are free to modify the data in place before passing the band on
+struct Band
+{
+    int * data;
+    int firstRow, numRows, width;
+};
+
+struct BandConsumer
+{
+    virtual ~BandConsumer() {}
+    virtual void begin(ImData & /* im */, int /* bandWidth */) {}
+    virtual void consume(Band & band) = 0;
+    virtual void finish() {}
+};
+
+// Picks the rows of one CR2 slice out of the scan order bands and crops them to [cropLeft, cropRight)
+struct SliceCropStage : BandConsumer
+{
+    int slice, cropLeft, cropRight, bandRows;
+    BandConsumer * next;
+
+    int sliceWidth;
+    long sliceBase, sliceEnd, pos;
+    Band out;
+
+    SliceCropStage(int slice, int cropLeft, int cropRight, int bandRows, BandConsumer * next);
+
+    void begin(ImData & im, int bandWidth);
+    void consume(Band & band);
+    void finish();
+};
+
+// Integrates the difference values along each row
+struct AccumulateStage : BandConsumer
+{
+    BandConsumer * next;
+
+    AccumulateStage(BandConsumer * next) : next(next) {};
+
+    void begin(ImData & im, int bandWidth) { next->begin(im, bandWidth); }
+    void consume(Band & band);
+    void finish() { next->finish(); }
+};
+
+// Writes the same 8 bit file as toFile
+struct DiffFileSink : BandConsumer
+{
+    const char * fname;
+    FILE * spill;
+    int width, height, min, max;
+
+    DiffFileSink(const char * fname) : fname(fname), spill(NULL), width(0), height(0), min(0), max(0) {};
+
+    void begin(ImData & im, int bandWidth);
+    void consume(Band & band);
+    void finish();
+};
+
+// Keeps every band it gets, for comparing the band chain with the full frame decode
+struct BandCollector : BandConsumer
+{
+    std::vector<int> values;
+
+    void consume(Band & band) { values.insert(values.end(), band.data, band.data + long(band.numRows)*band.width); }
+};
+
+// ==================================================================================================================================================================================================
+// MISC FUNCTIONS (TIDY UP)
+// ==================================================================================================================================================================================================
+
+void toFile(const char * fname, unsigned char * data, int width, int height);
+bool toFile16(const char * fname, uint16_t * data, int width, int height, int channels);
+void unslice(uint16_t * dst, const uint16_t * src, ImData & im);
+
+template <typename T>
+void getMinMax(T* , T* , T* , int, int);
+template <>
+void getMinMax<int>(int * outMin, int * outMax, int * in, int start, int stop);
+
+template <typename T>
+void freadVar(T*, InputFile*);
+
+void printFatLine();
+void printThinLine();
+void printTiffTag(TIFF_TAG tiff_tag, InputFile * in);
+void readTagString(TIFF_TAG tag, InputFile * in, char * dst, int dstSize);
+void printTagInfo(TIFF_TAG tag);
+void printTagType(TIFF_TAG tag);
+void printPointerDataTag(TIFF_TAG tag, InputFile * in);
+void printSensorDescriptor(int val);
+void huffCodes(uint8_t * huffData, uint16_t * table);
+long unstuffScalar(uint8_t * out, const uint8_t * in, long i, long size, long & markers);
+long unstuff(uint8_t * out, const uint8_t * stuffed, long stuffedSize, bool simd, long & markers);
+double monotonicSeconds();
+void printBits(uint16_t integer);
+void printBits(uint8_t integer);
+template <typename T>
+void getDiffValues(T * diffOut, ImData im, DecodeOptions opts);
+bool parseHeaders(ImData * im, bool verbose);
+bool parsePreviews(InputFile * in, PreviewInfo * pv);
+int extractPreviews(InputFile * in, const char * outPrefix, bool verbose);
+long decodePhotosites(uint16_t * photosites, ImData & im, DecodeOptions opts, ImageWriter * writer);
+bool readAll(int fd, uint8_t * data, long size);
+bool slicesAligned(ImData & im);
+bool singleTable(const ImData & im);
+bool isSraw(const ImData & im);
+double srawToRgb(uint16_t * rgb, const uint16_t * luma, const uint16_t * cb, const uint16_t * cr, ImData & im, int numThreads);
+int runSraw(ImData & im, const char * out_fname, DecodeOptions opts);
+long decodeFrameParallel(uint16_t * frame, ScanDecoder & scan, ImData & im, int numThreads, ParallelTiming * timing);
+void scanSweep(ImData & im, DecodeOptions opts);
+int runRoi(const char * in_fname, const char * out_fname, DecodeOptions opts);
+int runBin(const char * in_fname, const char * out_fname, DecodeOptions opts);
+int runBatch(const char * source, const char * outDir, DecodeOptions opts);
+int runIndex(const char * source, const char * out_fname, DecodeOptions opts);
+bool writeFrameStats(const char * fname, const std::string & record);
+bool writeSynthCr2(const char * fname, uint16_t * photosites, SynthParams & sp);
+int runBench(const char * in_fname, const char * report_fname, DecodeOptions opts);
+void accumulateRows(int * rows, int width, int numRows);
+template <typename T>
+void accumulateRow(int * sums, const T * diffs, int width, int start);
+double demosaic(uint16_t * rgb, const uint16_t * mosaic, int width, int height, int maxValue, DecodeOptions opts);
+int imageFormat(const char * fname);
+const char * imageExtension(int format, int channels);
+template <typename T>
+void integrateBayerRows(T * rows, int width, int numRows, int rowPeriod, int seed);
+void loadScan(ByteStream * bstream, ImData & im);
+void decodeBands(ImData im, DecodeOptions opts, BandConsumer * consumer);
+
+int elementSizeTag(TIFF_TAG tag);
+int dataSizeTag(TIFF_TAG tag);
+const SeamModel * seamModel(const ImData & im, int seamCorrect);
+template <typename T>
+int correctSeams(T * rows, int width, int firstRow, int numRows, const SeamModel & seam);
+template <typename T>
+int fixRowStarts(T * rows, int width, int firstRow, int numRows, const SeamModel * seam);
+unsigned char toUChar(int dVal, int maxAbs);
+void toUCharRow(uchar * dst, const int * src, long n, int maxAbs);
+
+int main(int argc, char * argv[])
+{
+
+    // Check that input is proper
+    DecodeOptions decodeOpts;
+    SynthParams synthParams;
+    char * in_fname  = NULL;
+    char * out_fname = NULL;
+    int numArgs = 0;
+    int badOption = 0; // An option that takes one of a few names and got none of them
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--huff-search") == 0)
+            decodeOpts.huffSearch = true;
+        else if (strcmp(argv[i], "--legacy-bits") == 0)
+            decodeOpts.legacyBits = true;
+        else if (strcmp(argv[i], "--no-simd") == 0)
+            decodeOpts.simd = false;
+        else if (strcmp(argv[i], "--mmap") == 0)
+            decodeOpts.mmap = true;
+        else if (strcmp(argv[i], "--seam-correct") == 0)
+            decodeOpts.seamCorrect = 1;
+        else if (strcmp(argv[i], "--no-seam-correct") == 0)
+            decodeOpts.seamCorrect = 0;
+        else if (strcmp(argv[i], "--photosites") == 0)
+            decodeOpts.photosites = true;
+        else if (strcmp(argv[i], "--demosaic") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "ppg") == 0)
+                decodeOpts.demosaic = DEMOSAIC_PPG;
+            else if (strcmp(argv[i], "bilinear") == 0)
+                decodeOpts.demosaic = DEMOSAIC_BILINEAR;
+            else
+                badOption = i - 1;
+            decodeOpts.photosites = true;
+        }
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcasecmp(argv[i], "tiff") == 0 || strcasecmp(argv[i], "tif") == 0)
+                decodeOpts.format = FORMAT_TIFF;
+            else if (strcasecmp(argv[i], "pnm") == 0 || strcasecmp(argv[i], "pgm") == 0 || strcasecmp(argv[i], "ppm") == 0)
+                decodeOpts.format = FORMAT_PNM;
+            else if (strcasecmp(argv[i], "dat") == 0)
+                decodeOpts.format = FORMAT_DAT;
+            else
+                badOption = i - 1;
+        }
+        else if (strcmp(argv[i], "--planar") == 0)
+            decodeOpts.planar = true;
+        else if (strcmp(argv[i], "--bayer") == 0 && i + 1 < argc)
+        {
+            // Where R is in the top left 2x2 block, the default is RGGB
+            i++;
+            decodeOpts.bayerX = strcasecmp(argv[i], "GRBG") == 0 || strcasecmp(argv[i], "BGGR") == 0;
+            decodeOpts.bayerY = strcasecmp(argv[i], "GBRG") == 0 || strcasecmp(argv[i], "BGGR") == 0;
+            if (!decodeOpts.bayerX && !decodeOpts.bayerY && strcasecmp(argv[i], "RGGB") != 0)
+                badOption = i - 1;
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+            decodeOpts.batch = true;
+        else if (strcmp(argv[i], "--preview") == 0)
+            decodeOpts.preview = true;
+        else if (strcmp(argv[i], "--index") == 0)
+            decodeOpts.index = true;
+        else if (strcmp(argv[i], "--synth") == 0)
+            decodeOpts.synth = true;
+        else if (strcmp(argv[i], "--synth-size") == 0 && i + 1 < argc)
+            sscanf(argv[++i], "%dx%d", &synthParams.width, &synthParams.height);
+        else if (strcmp(argv[i], "--synth-slices") == 0 && i + 1 < argc)
+            sscanf(argv[++i], "%hu,%hu,%hu", &synthParams.slices[0], &synthParams.slices[1], &synthParams.slices[2]);
+        else if (strcmp(argv[i], "--synth-noise") == 0 && i + 1 < argc)
+            synthParams.noise = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--synth-seed") == 0 && i + 1 < argc)
+            synthParams.seed = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--synth-tables") == 0 && i + 1 < argc)
+        {
+            // One digit per component, e.g. 0101
+            i++;
+            for (int c = 0; c < 4 && argv[i][c]; c++)
+                synthParams.tables[c] = argv[i][c] == '1';
+        }
+        else if (strcmp(argv[i], "--synth-sraw") == 0 && i + 1 < argc)
+        {
+            i++;
+            synthParams.lumaV = strcmp(argv[i], "420") == 0 ? 2 : 1;
+            if (strcmp(argv[i], "420") != 0 && strcmp(argv[i], "422") != 0)
+                badOption = i - 1;
+        }
+        else if (strcmp(argv[i], "--bench") == 0)
+            decodeOpts.bench = true;
+        else if (strcmp(argv[i], "--bench-reps") == 0 && i + 1 < argc)
+            decodeOpts.benchReps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+            stats.level = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc)
+            decodeOpts.statsFile = argv[++i];
+        else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc)
+            decodeOpts.scanThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--scan-sweep") == 0)
+            decodeOpts.scanSweep = true;
+        else if (strcmp(argv[i], "--bin") == 0 && i + 1 < argc)
+            decodeOpts.bin = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bin-gray") == 0)
+            decodeOpts.binGray = true;
+        else if (strcmp(argv[i], "--roi") == 0 && i + 1 < argc)
+            sscanf(argv[++i], "%d,%d,%d,%d", &decodeOpts.roi[0], &decodeOpts.roi[1], &decodeOpts.roi[2], &decodeOpts.roi[3]);
+        else if (strcmp(argv[i], "--checkpoint-lines") == 0 && i + 1 < argc)
+            decodeOpts.checkpointLines = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            decodeOpts.threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-inflight-mb") == 0 && i + 1 < argc)
+            decodeOpts.maxInflightMB = atol(argv[++i]);
+        else if (strcmp(argv[i], "--read-ahead") == 0 && i + 1 < argc)
+            decodeOpts.readAhead = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--read-ahead-mb") == 0 && i + 1 < argc)
+            decodeOpts.readAheadMB = atol(argv[++i]);
+        else if (strcmp(argv[i], "--frame-stats") == 0 && i + 1 < argc)
+        {
+            decodeOpts.frameStatsFile = argv[++i];
+            decodeOpts.photosites = true;
+        }
+        else if (strcmp(argv[i], "--bands") == 0 && i + 1 < argc)
+            decodeOpts.bandRows = atoi(argv[++i]);
+        else if (numArgs == 0)
+            in_fname = argv[i], numArgs++;
+        else if (numArgs == 1)
+            out_fname = argv[i], numArgs++;
+        else
+            numArgs++;
+    }
+
+    if (badOption)
+        printf("\nError: %s does not take \"%s\"\n", argv[badOption], argv[badOption + 1]);
+    if (numArgs != 2 || badOption) 
+    {
+        printf("\nThis application takes two arguments:\n\nmain.a [options] <input> <output>\n\n");
+        printf("Options:\n\n");
+        printf("  --huff-search    decode with the original linear Huffman code search instead of the lookup table (implies --legacy-bits)\n");
+        printf("  --legacy-bits    read the scan with the original byte at a time ByteStream reader\n");
+        printf("  --no-simd        do not use SSE2 when removing stuffed bytes from the scan\n");
+        printf("  --mmap           map the input file into memory instead of reading it with fread\n");
+        printf("  --seam-correct   interpolate the first 4 difference values of every other scan row, by default only for the\n");
+        printf("                   camera models known to need it; --no-seam-correct never does\n");
+        printf("  --bands <rows>   decode and process the image in bands of <rows> rows to bound the memory use\n");
+        printf("  --photosites     write the 16 bit sensor values of the whole frame instead of 8 bit accumulated differences\n");
+        printf("  --demosaic <m>   with --photosites, write 16 bit RGB demosaiced with bilinear or ppg (patterned pixel grouping) on --threads\n");
+        printf("  --planar         write the demosaiced RGB as three planes instead of interleaved\n");
+        printf("  --bayer <p>      color filter pattern of the top left photosites, RGGB (default), GRBG, GBRG or BGGR\n");
+        printf("  --format <f>     write 16 bit PGM/PPM (pnm) or TIFF (tiff) instead of the raw dump (dat), by default from the extension of <output>\n");
+        printf("  --batch          <input> is a directory or a list of CR2 files and <output> a directory, every file is decoded with --photosites\n");
+        printf("  --frame-stats <file>  with --photosites or --batch, write per Bayer channel histograms, min, max, mean, variance and\n");
+        printf("                   clipped counts of the active area and the masked border as one JSON line per file to <file>\n");
+        printf("  --stats <level>  write stage times (1) and counters (2) of the decode as JSON to stdout or to --stats-file <file>\n");
+        printf("  --synth          write a synthetic CR2 file to <input> and the photosites it encodes to <output>, see --synth-size WxH,\n");
+        printf("                   --synth-slices count,width,last, --synth-noise <amplitude>, --synth-seed <n>, --synth-tables <0|1 x4>\n");
+        printf("                   and --synth-sraw 422|420 for an sRAW file, whose <output> is then the RGB it decodes to\n");
+        printf("  --bench          time the decode kernels on <input> and write the results as CSV to <output>, --bench-reps <n> runs each\n");
+        printf("  --index          <input> is a CR2 file, a directory or a list of them, write one metadata record per file to <output> (.csv or .jsonl)\n");
+        printf("  --preview        write the embedded previews to <output>.jpg, <output>.thumb.jpg and <output>.ppm without decoding the raw data\n");
+        printf("  --threads <n>    number of batch worker threads, one per core by default\n");
+        printf("  --max-inflight-mb <mb>  bound on the buffers of the files being decoded in a batch, 2048 by default\n");
+        printf("  --read-ahead <n>        number of batch files a reader thread reads ahead of the workers, 4 by default, 0 to read on the workers\n");
+        printf("  --read-ahead-mb <mb>    bound on the bytes read ahead, 512 by default\n");
+        printf("  --scan-threads <n>      with --photosites, split the entropy decoding of the scan over <n> threads\n");
+        printf("  --scan-sweep            with --photosites, time the split decoding for 1 to <n> threads against the sequential decoding\n");
+        printf("  --roi x,y,w,h           decode only a region of the frame, from the checkpoints of the sidecar index <input>.idx (built by the\n");
+        printf("                          first such decode, every --checkpoint-lines <n> scan lines) on --threads\n");
+        printf("  --bin <f>               write a preview at 1/<f> scale (2, 4, 8), every pixel the mean of a <f>x<f> block of photosites per\n");
+        printf("                          Bayer color, binned as the scan lines are decoded; --bin-gray for one gray value per block\n\n");
+        return badOption ? 1 : 0;
+    }
+
+    if (decodeOpts.index)
+        return runIndex(in_fname, out_fname, decodeOpts);
+
+    if (decodeOpts.synth)
+    {
+        int channels = synthParams.lumaV ? 3 : 1;
+        uint16_t * photosites = new uint16_t [long(channels)*synthParams.width*synthParams.height];
+        bool ok = writeSynthCr2(in_fname, photosites, synthParams) && 
+                  toFile16(out_fname, photosites, synthParams.width, synthParams.height, channels);
+        delete [] photosites;
+        if (ok)
+            printf("Wrote a synthetic %dx%d CR2 file to \"%s\" and its %s to \"%s\"\n", synthParams.width, synthParams.height, in_fname, 
+                   synthParams.lumaV ? "RGB" : "photosites", out_fname);
+        return ok ? 0 : 1;
+    }
+
+    if (decodeOpts.bench)
+        return runBench(in_fname, out_fname, decodeOpts);
+
+    if (decodeOpts.batch)
+        return runBatch(in_fname, out_fname, decodeOpts);
+
+    if (decodeOpts.roi[2] > 0 && decodeOpts.roi[3] > 0)
+        return runRoi(in_fname, out_fname, decodeOpts);
+
+    if (decodeOpts.bin)
+        return runBin(in_fname, out_fname, decodeOpts);
+
+    InputFile input;
+
+    // The previews are written straight from the mapping
+    if ( !input.open(in_fname, decodeOpts.mmap || decodeOpts.preview) )
+    {
+        printf("The file \"%s\" cannot be located or successfully opened!", in_fname);
+        return 0;
+    }
+
+    if (decodeOpts.preview)
+    {
+        double start = monotonicSeconds();
+        int numWritten = extractPreviews(&input, out_fname, true);
+        printf("Wrote %d previews in %.3f ms\n", numWritten, 1e3*(monotonicSeconds() - start));
+        input.close();
+        return 0;
+    }
+
+    
+    ImData imageData;
+    imageData.input = &input;
+
+    stats.start(STAGE_HEADERS);
+    bool parsed = parseHeaders(&imageData, true);
+    stats.stop(STAGE_HEADERS);
+    if (!parsed)
+    {
+        printf("The file \"%s\" is not a CR2 file that can be decoded!\n", in_fname);
+        input.close();
+        return 0;
+    }
+
+    if (isSraw(imageData))
+    {
+        int result = runSraw(imageData, out_fname, decodeOpts);
+        if (stats.level)
+            stats.write(decodeOpts.statsFile, in_fname);
+        input.close();
+        return result;
+    }
+
+    // ==================================================================================================================================================================================================
+    // DECODING SCAN DATA
+    // ==================================================================================================================================================================================================
+    
+    printf("\n\nAttempting to decode from binary to difference values\n");
+
+    int format = decodeOpts.format >= 0 ? decodeOpts.format : imageFormat(out_fname);
+
+    if (decodeOpts.photosites)
+    {
+        long frame = long(imageData.sensor_width)*imageData.sensor_height;
+        uint16_t * photosites = new uint16_t [frame];
+        stats.alloc(frame*sizeof(uint16_t));
+
+        // Without demosaicing the rows are written while the last slice is decoded
+        ImageWriter writer;
+        int maxValue = (1 << imageData.precision) - 1;
+        if (!decodeOpts.demosaic && !writer.open(out_fname, format, imageData.sensor_width, imageData.sensor_height, 1, maxValue))
+        {
+            delete [] photosites;
+            input.close();
+            return 1;
+        }
+
+        // The statistics are gathered from the rows handed to the writer, or from the frame when the writer gets RGB
+        FrameStats frameStats;
+        if (decodeOpts.frameStatsFile)
+        {
+            frameStats.begin(imageData, decodeOpts);
+            writer.frameStats = decodeOpts.demosaic ? NULL : &frameStats;
+        }
+
+        double decodeStart = monotonicSeconds();
+        long badCodes = decodePhotosites(photosites, imageData, decodeOpts, decodeOpts.demosaic ? NULL : &writer);
+        double decodeTime = monotonicSeconds() - decodeStart;
+        printf("Decoded %ld photosites in %.3f ms (%.1f MB/s of scan data)\n", 
+               frame, 1e3*decodeTime, imageData.raw_scan_size/decodeTime/1e6);
+        if (badCodes)
+            printf("We didn't find code %ld times :O :O \n\n", badCodes);
+
+        if (decodeOpts.scanSweep)
+            scanSweep(imageData, decodeOpts);
+
+        if (decodeOpts.frameStatsFile)
+        {
+            if (decodeOpts.demosaic)
+                frameStats.addRows(photosites, 0, imageData.sensor_height);
+            if (writeFrameStats(decodeOpts.frameStatsFile, frameStats.record(in_fname)))
+                printf("Wrote the frame statistics to \"%s\"\n", decodeOpts.frameStatsFile);
+        }
+
+        if (decodeOpts.demosaic)
+        {
+            uint16_t * rgb = new uint16_t [3*frame];
+            stats.alloc(3*frame*sizeof(uint16_t));
+
+            // PGM/PPM and TIFF are written interleaved, only the raw dump can hold three planes
+            if (format != FORMAT_DAT)
+                decodeOpts.planar = false;
+
+            stats.start(STAGE_DEMOSAIC);
+            double demosaicTime = demosaic(rgb, photosites, imageData.sensor_width, imageData.sensor_height, maxValue, decodeOpts);
+            stats.stop(STAGE_DEMOSAIC);
+            printf("Demosaiced in %.3f ms (%.1f megapixels/s)\n", 1e3*demosaicTime, frame/demosaicTime/1e6);
+
+            stats.start(STAGE_OUTPUT);
+            if (writer.open(out_fname, format, imageData.sensor_width, imageData.sensor_height, 3, maxValue))
+                writer.writeRows(rgb, imageData.sensor_height);
+            stats.stop(STAGE_OUTPUT);
+            delete [] rgb;
+        }
+
+        // Only the rows that were still in the buffers are left to write, a writer that failed or never opened fails the decode
+        stats.start(STAGE_OUTPUT);
+        bool written = writer.close();
+        stats.stop(STAGE_OUTPUT);
+        delete [] photosites;
+
+        printf("Decoding complete!\n");
+        input.close();
+        if (stats.level)
+            stats.write(decodeOpts.statsFile, in_fname);
+        return written ? 0 : 1;
+    }
+
+    if (decodeOpts.bandRows > 0)
+    {
+        // Same output as below, byte for byte, but only a few bands are held in memory at any time
+        printf("Decoding in bands of %d rows\n", decodeOpts.bandRows);
+
+        int slice = imageData.cr2_slice[0] > 0 ? 1 : 0;
+        int sliceWidth = slice < imageData.cr2_slice[0] ? imageData.cr2_slice[1] : imageData.cr2_slice[2];
+        DiffFileSink    sink(out_fname);
+        AccumulateStage accumulate(&sink);
+        SliceCropStage  crop(slice, 0, sliceWidth < 1728 ? sliceWidth : 1728, decodeOpts.bandRows, &accumulate);
+        decodeBands(imageData, decodeOpts, &crop);
+
+        printf("Decoding complete!\n");
+        input.close();
+        if (stats.level)
+            stats.write(decodeOpts.statsFile, in_fname);
+        return 0;
+    }
+
+    // Every buffer of the decode comes out of one arena: the 16 bit difference values of the frame, a row of integrated
+    // values and the output. The slice and the crop are views into the difference values, not copies.
+    long numDiffValues = long(imageData.sensor_width)*imageData.sensor_height;
+
+    // RG RG RG RG RG RG RG RG RG RG RG ...
+    // GB GB GB GB GB GB GB GB GB GB GB ...
+
+    // Cropped second slice, or the only one, at most 1728 columns of it
+    int slice = imageData.cr2_slice[0] > 0 ? 1 : 0;
+    int sliceWidth = slice < imageData.cr2_slice[0] ? imageData.cr2_slice[1] : imageData.cr2_slice[2];
+    int cropTop = 0;
+    int cropLeft = 0;
+    int cropRight = sliceWidth < 1728 ? sliceWidth : 1728;
+    int cdWidth  = cropRight - cropLeft;
+    int cdHeight = imageData.sensor_height - cropTop;
+    long cdLen   = long(cdWidth)*cdHeight;
+
+    Arena arena;
+    long outBytes = format == FORMAT_DAT ? cdLen : cdWidth*sizeof(uint16_t);
+    if (!arena.reserve(numDiffValues*sizeof(int16_t) + cdWidth*sizeof(int) + outBytes + 3*ARENA_ALIGN))
+    {
+        printf("The buffers for \"%s\" cannot be allocated!\n", in_fname);
+        input.close();
+        return 1;
+    }
+
+    // getDiffValues writes every value, the first one of every other row as 0
+    int16_t * diffValueList = arena.alloc<int16_t>(numDiffValues);
+
+    // Function that decodes binary data to produce difference values (RGGB diff values in this case)
+    getDiffValues(diffValueList, imageData, decodeOpts);
+
+    printf("Decoding complete!\n");
+
+    // =====================================================================
+    // Un-slicing difference values
+    // =====================================================================
+
+    stats.start(STAGE_UNSLICE);
+    printf("trying to get bayer data\n");
+    const int16_t * sliceTwo = diffValueList + long(slice)*imageData.cr2_slice[1]*imageData.sensor_height;
+
+    printf("cropping\n");
+    const int16_t * cdSliceOne = sliceTwo + long(cropTop)*sliceWidth + cropLeft; // Rows are sliceWidth apart
+    stats.stop(STAGE_UNSLICE);
+
+    printf("accumulating\n"); 
+    stats.start(STAGE_INTEGRATE);
+    // The integrated values need more than 16 bits, so they are only held a row at a time. This pass finds their range,
+    // the output integrates the rows again, which costs less than storing them.
+    int * accumRow = arena.alloc<int>(cdWidth);
+    int min = 0, max = 0;
+    for (int i = 0; i < cdHeight; i++)
+    {
+        int rowMin, rowMax;
+        accumulateRow(accumRow, cdSliceOne + long(i)*sliceWidth, cdWidth, 20000);
+        getMinMax(&rowMin, &rowMax, accumRow, 0, cdWidth);
+        min = i == 0 || rowMin < min ? rowMin : min;
+        max = i == 0 || rowMax > max ? rowMax : max;
+    }
+
+    printf("converting to uchar\n");
+    printf("the Bayer (min,max) = (%d, %d)\n", min, max);
+    int absmax = (abs(min) > abs(max)) ? abs(min) : abs(max) ;
+    printf("Absmax = %d\n", absmax);
+    stats.stop(STAGE_INTEGRATE);
+
+    // =====================================================================
+    // CLOSING FILE
+    // =====================================================================
+
+    input.close();
+
+    // =====================================================================
+    // Writing channel data to file
+    // =====================================================================
+
+    stats.start(STAGE_OUTPUT);
+    if (format == FORMAT_DAT)
+    {
+        uchar * accum = arena.alloc<uchar>(cdLen);
+        for (int i = 0; i < cdHeight; i++)
+        {
+            accumulateRow(accumRow, cdSliceOne + long(i)*sliceWidth, cdWidth, 20000);
+            toUCharRow(accum + long(i)*cdWidth, accumRow, cdWidth, absmax);
+        }
+        toFile(out_fname, accum, cdWidth, cdHeight);
+    }
+    else
+    {
+        // 16 bits instead of the 8 bit scaling, the integrated values are shifted to start at zero
+        ImageWriter writer;
+        uint16_t * row = arena.alloc<uint16_t>(cdWidth);
+        if (writer.open(out_fname, format, cdWidth, cdHeight, 1, 65535))
+        {
+            for (int i = 0; i < cdHeight; i++)
+            {
+                accumulateRow(accumRow, cdSliceOne + long(i)*sliceWidth, cdWidth, 20000);
+                for (int j = 0; j < cdWidth; j++)
+                {
+                    int v = accumRow[j] - min;
+                    row[j] = v < 65535 ? v : 65535;
+                }
+                writer.writeRows(row, 1);
+            }
+            writer.close();
+        }
+    }
+    stats.stop(STAGE_OUTPUT);
+    printf("Peak arena use %ld bytes, %.2f per photosite\n", arena.peak, double(arena.peak)/numDiffValues);
+
+    if (stats.level)
+        stats.write(decodeOpts.statsFile, in_fname);
+}
+
+bool parseHeaders(ImData * im, bool verbose)
+{
+    // Everything is read through im->input, nothing outside of im is touched so files can be parsed in parallel
+    InputFile * in = im->input;
+    *im = ImData();
+    im->input = in;
+
+    // =====================================================================
+    // TIFF AND CR2 HEADERS
+    // =====================================================================
+
+    if (verbose) printFatLine();
+    freadVar(&im->tiff_header, in);
+    freadVar(&im->cr2_header, in);
+    if (verbose) printFatLine();
+    
+    // =====================================================================
+    // IFD #0
+    // =====================================================================
+   
+    if (verbose) printf("IFD#0 :");
+    if (verbose) printFatLine();
+
+    uint16_t num_IFD_entries;
+    freadVar(&num_IFD_entries, in);
+       
+       TIFF_TAG tiff_tag;
+    for (int i = 0; i < num_IFD_entries; i++)    
+    {
+        if (verbose) printf("Entry number %d ", i);
+        freadVar(&tiff_tag, in);
+        if (tiff_tag.ID == EXIF)
+        {
+            im->exif_subdir_offset = tiff_tag.value;
+        }
+        if (tiff_tag.ID == MAKE)
+            readTagString(tiff_tag, in, im->make, sizeof(im->make));
+        if (tiff_tag.ID == MODEL)
+            readTagString(tiff_tag, in, im->model, sizeof(im->model));
+        if (verbose) printTiffTag(tiff_tag, in);
+    }
+    if (verbose) printFatLine();
+
+    // =====================================================================
+    // EXIF SUBDIR (of TIFF)
+    // =====================================================================
+
+    if (verbose) printf("EXIF SUBDIR:");
+    if (verbose) printFatLine();
+    in->seek(im->exif_subdir_offset);
+    freadVar(&num_IFD_entries, in);
+    for (int i = 0; i < num_IFD_entries; i++)    
+    {
+        freadVar(&tiff_tag, in);
+        if (tiff_tag.ID == MAKERNOTE)
+        {
+            im->makernote_offset = tiff_tag.value;
+        }
+        if (tiff_tag.ID == EXPOSURE_TIME || tiff_tag.ID == F_NUMBER)
+        {
+            long currentOffset = in->tell();
+            in->seek(tiff_tag.value);
+            in->read(tiff_tag.ID == EXPOSURE_TIME ? im->exposure_time : im->f_number, sizeof(uint32_t), 2);
+            in->seek(currentOffset);
+        }
+        if (verbose) printTiffTag(tiff_tag, in);
+    }
+    if (verbose) printf("\n");
+    if (verbose) printFatLine();
+
+    // =====================================================================
+    // Makernote
+    // =====================================================================
+
+       if (verbose) printf("Makernote: (displaying sensor data only)");
+       if (verbose) printFatLine();
+       in->seek(im->makernote_offset);
+       freadVar(&num_IFD_entries, in);
+
+       for (int i = 0; i < num_IFD_entries; i++)
+       {
+           freadVar(&tiff_tag, in);
+           if (tiff_tag.ID == SENSOR_INFO)
+           {
+               in->seek(tiff_tag.value);
+               uint16_t numEntries;
+               freadVar(&numEntries, in);
+               if (verbose) printf("\n");
+               for( int j = 0; j < 8; j++)
+               {
+                   uint16_t entryVal;
+                   freadVar(&entryVal, in);
+                   if (verbose) printSensorDescriptor(j);
+                   if (verbose) printf(" = %d\n", entryVal);
+
+                   if (j == 0)
+                       im->sensor_width = entryVal;
+                   if (j == 1)
+                       im->sensor_height = entryVal;
+                   if (j == 4)
+                       im->sensor_left_border = entryVal;
+                   if (j == 5)
+                       im->sensor_top_border = entryVal;
+                   if (j == 6)
+                       im->sensor_right_border = entryVal;
+                   if (j == 7)
+                       im->sensor_bottom_border = entryVal;
+               }
+           }
+       }
+       if (verbose) printFatLine();
+
+    // =====================================================================
+    // RAW IFD 
+    // =====================================================================
+   
+    if (verbose) printf("RAW IFD :");
+    if (verbose) printFatLine();
+    in->seek(im->cr2_header.offset);
+    in->read(&num_IFD_entries, sizeof(num_IFD_entries), 1);
+
+    for (int i = 0; i < num_IFD_entries; i++)    
+    {
+        if (verbose) printf("Entry number %d ", i);
+        if (verbose) printThinLine();
+        freadVar(&tiff_tag, in);
+        long currentOffset = in->tell();
+
+        if (tiff_tag.ID == STRIP_OFFSET) // Offset of raw
+        {
+            im->raw_offset = tiff_tag.value;
+        }
+        if (tiff_tag.ID == STRIP_BYTE_COUNTS) // Size of raw in bytes
+        {
+            im->raw_size = tiff_tag.value;
+        }
+        if (tiff_tag.ID == CR2_SLICE)
+        {
+            in->seek(tiff_tag.value);
+            in->read(&im->cr2_slice, sizeof(uint16_t), tiff_tag.values < 3 ? tiff_tag.values : 3);
+            in->seek(currentOffset);
+        }
+
+        if (verbose) printTiffTag(tiff_tag, in);
+    }
+    if (verbose) printFatLine();
+    // =====================================================================
+
+    // =====================================================================
+    // RAW FILE HEADERS
+    // =====================================================================
+
+    in->seek(im->raw_offset);
+
+    uint16_t soi_marker;
+    freadVar(&soi_marker, in);
+    if (verbose) printf("SOI_MARKER = %04x\n", swapBytes(soi_marker));
+
+    // The marker segments up to the scan are read whole and parsed by their length, so the headers may hold any number
+    // of components and DHT tables. Segments other than DHT, SOF3 and SOS are skipped.
+    uint8_t segment [65536];
+    int tablesDefined = 0;
+    bool haveSos = false;
+    while (!haveSos)
+    {
+        long segmentOffset = in->tell();
+        uint16_t marker, length;
+        if (in->read(&marker, sizeof(marker), 1) != 1 || in->read(&length, sizeof(length), 1) != 1)
+        {
+            printf("Error in parseHeaders(): the raw data ends before the scan\n");
+            return false;
+        }
+        marker = swapBytes(marker);
+        length = swapBytes(length);
+        int n = length - 2;
+        if ((marker >> 8) != 0xFF || n < 0 || in->read(segment, 1, n) != n)
+        {
+            printf("Error in parseHeaders(): bad marker segment %04x of length %d at %ld\n", marker, length, segmentOffset);
+            return false;
+        }
+
+        // =====================================================================
+        // DHT HEADER
+        // =====================================================================
+
+        if (marker == 0xFFC4)
+        {
+            if (verbose) printf("\n\nDHT_HEADER\n\n");
+            if (verbose) printf("%6s = %04x\n", "Marker", marker);
+            if (verbose) printf("%6s = %d\n"  , "Length", length);
+            im->raw_dht_offset = segmentOffset;
+
+            // One or more tables, each its class and index, the number of codes of every length and the values
+            for (int p = 0; p < n; )
+            {
+                int table = segment[p] & 0x0F;
+                int numValues = 0;
+                for (int i = 0; i < 16 && p + 17 <= n; i++)
+                    numValues += segment[p + 1 + i];
+                if (table > 1 || p + 17 + numValues > n || numValues > HUFF_MAX_VALUES)
+                {
+                    printf("Error in parseHeaders(): DHT table %d with %d values, only tables 0 and 1 of up to %d values are supported\n", table, numValues, HUFF_MAX_VALUES);
+                    return false;
+                }
+
+                uint8_t * huffData = table ? im->huffData1 : im->huffData;
+                int * huffValues   = table ? im->huffValues1 : im->huffValues;
+                memcpy(huffData, segment + p + 1, 16);
+                for (int i = 0; i < HUFF_MAX_VALUES; i++)
+                    huffValues[i] = i < numValues ? segment[p + 17 + i] : 0;
+                tablesDefined |= 1 << table;
+                p += 17 + numValues;
+
+                if (verbose) printf("%6s = %d, %d codes\n", "Table", table, numValues);
+            }
+        }
+
+        // =====================================================================
+        // SOF3 HEADER
+        // =====================================================================
+
+        else if (marker == 0xFFC3)
+        {
+            int numComp = n >= 6 ? segment[5] : 0;
+            if (n < 6 + 3*numComp)
+            {
+                printf("Error in parseHeaders(): SOF3 of length %d is too short\n", length);
+                return false;
+            }
+            im->raw_sof3_offset  = segmentOffset;
+            im->precision        = segment[0];
+            im->num_lines        = (segment[1] << 8) | segment[2];
+            im->samples_per_line = (segment[3] << 8) | segment[4];
+            im->num_comp         = numComp;
+            im->lumaH            = numComp ? segment[7] >> 4 : 1;
+            im->lumaV            = numComp ? segment[7] & 15 : 1;
+            if (im->precision < 2 || im->precision > 16)
+            {
+                printf("Error in parseHeaders(): a precision of %d bits is not supported, only 2 to 16\n", im->precision);
+                return false;
+            }
+
+            if (verbose) printf("\n\nSOF3_HEADER\n\n");
+            if (verbose) printf("%15s = %04x\n", "Marker", marker);
+            if (verbose) printf("%15s = %04x\n", "Length", length);
+            if (verbose) printf("%15s = %d\n"  , "SampleP", im->precision);
+            if (verbose) printf("%15s = %d\n"  , "Num Lines", im->num_lines);
+            if (verbose) printf("%15s = %d\n"  , "Samp per line", im->samples_per_line);
+            if (verbose) printf("%15s = %d\n"  , "# comp per frame", numComp);
+            if (verbose) printf("\n");
+
+            // Component id, sampling factors and quantization table
+            for (int i = 0; verbose && i < numComp; i++)
+                printf("%02x : %02x : %02x\n", segment[6 + 3*i], segment[7 + 3*i], segment[8 + 3*i]);
+        }
+
+        // =====================================================================
+        // SOS HEADER
+        // =====================================================================
+
+        else if (marker == 0xFFDA)
+        {
+            int numComp = n >= 1 ? segment[0] : 0;
+            if (n < 4 + 2*numComp || numComp > 4)
+            {
+                printf("Error in parseHeaders(): SOS of length %d with %d components\n", length, numComp);
+                return false;
+            }
+            im->raw_sos_offset = segmentOffset;
+            haveSos = true;
+
+            if (verbose) printf("\n\n\n");
+            if (verbose) printf("SOS_HEADER\n\n");
+            if (verbose) printf("%6s = %04x\n", "Marker", marker);
+            if (verbose) printf("%6s = %d\n"  , "Length", length);
+            if (verbose) printf("%6s = %d\n"  , "# comp", numComp);
+            if (verbose) printf("\n");
+            if (verbose) printf("%s", "Scan component selector : \n");
+
+            // The components in the order they are interleaved, each with its DHT table in the high nibble
+            for (int i = 0; i < numComp; i++)
+            {
+                im->compTable[i] = segment[2 + 2*i] >> 4;
+                if (verbose) printf("%20s %x %20s %02x\n", " ", segment[1 + 2*i], " ", segment[2 + 2*i]);
+            }
+            if (numComp != im->num_comp)
+            {
+                printf("Error in parseHeaders(): the scan has %d of the %d components, only single scan files are supported\n", numComp, im->num_comp);
+                return false;
+            }
+
+            if (verbose) printf("Last three bytes: \n");
+            for (int i = 0; verbose && i < 3; i++)
+                printf("%20s %02x\n", " ", segment[1 + 2*numComp + i]);
+        }
+        else if (verbose)
+            printf("\n\nSkipped marker %04x of length %d\n", marker, length);
+    }
+
+    for (int i = 0; i < im->num_comp; i++)
+    {
+        if (im->compTable[i] > 1 || !(tablesDefined & (1 << im->compTable[i])))
+        {
+            printf("Error in parseHeaders(): component %d uses the undefined DHT table %d\n", i, im->compTable[i]);
+            return false;
+        }
+    }
+
+    im->raw_scan_offset = in->tell();
+    im->raw_scan_size = im->raw_size - (im->raw_scan_offset - im->raw_offset);
+
+    // =====================================================================
+    // SANITY CHECKS
+    // =====================================================================
+
+    if (im->tiff_header.id[0] != 'I' || im->tiff_header.id[1] != 'I' || im->cr2_header.id[0] != 'C' || im->cr2_header.id[1] != 'R')
+    {
+        printf("Error in parseHeaders(): not a CR2 file\n");
+        return false;
+    }
+    if (im->sensor_width == 0 || im->sensor_height == 0 || im->num_comp < 1 || im->num_comp > 4)
+    {
+        printf("Error in parseHeaders(): bad sensor size %d x %d or component count %d\n", im->sensor_width, im->sensor_height, im->num_comp);
+        return false;
+    }
+    if (im->lumaH*im->lumaV > 1)
+    {
+        // sRAW/mRAW, SOF3 counts MCUs of lumaH*lumaV luma samples, Cb and Cr per line and CR2_SLICE counts samples
+        int mcuSamples = im->lumaH*im->lumaV + 2;
+        if (im->num_comp != 3 || im->lumaH != 2 || im->lumaV > 2)
+        {
+            printf("Error in parseHeaders(): YCbCr with %d components and %dx%d luma sampling, only 4:2:2 and 4:2:0 are supported\n", im->num_comp, im->lumaH, im->lumaV);
+            return false;
+        }
+        if (im->cr2_slice[0] == 0 && im->cr2_slice[1] == 0 && im->cr2_slice[2] == 0)
+            im->cr2_slice[2] = im->samples_per_line*mcuSamples;
+        long rowSamples = long(im->cr2_slice[0])*im->cr2_slice[1] + im->cr2_slice[2];
+        long numMcus    = long(im->num_lines)*im->samples_per_line;
+        if ((im->cr2_slice[0] && im->cr2_slice[1] % mcuSamples) || im->cr2_slice[2] % mcuSamples || rowSamples == 0 || numMcus % (rowSamples/mcuSamples))
+        {
+            printf("Error in parseHeaders(): CR2 slices [%d, %d, %d] do not hold whole MCUs of the scan\n", im->cr2_slice[0], im->cr2_slice[1], im->cr2_slice[2]);
+            return false;
+        }
+        im->sraw_width  = rowSamples/mcuSamples*im->lumaH;
+        im->sraw_height = numMcus/(rowSamples/mcuSamples)*im->lumaV;
+    }
+    else
+    {
+        if (long(im->num_lines)*im->samples_per_line*im->num_comp != long(im->sensor_width)*im->sensor_height)
+        {
+            printf("Error in parseHeaders(): the scan does not cover the sensor\n");
+            return false;
+        }
+        if (im->cr2_slice[0] == 0 && im->cr2_slice[1] == 0 && im->cr2_slice[2] == 0)
+            im->cr2_slice[2] = im->sensor_width; // Not sliced, a single slice covering the sensor
+        if (long(im->cr2_slice[0])*im->cr2_slice[1] + im->cr2_slice[2] != im->sensor_width)
+        {
+            printf("Error in parseHeaders(): CR2 slices [%d, %d, %d] do not add up to the sensor width\n", im->cr2_slice[0], im->cr2_slice[1], im->cr2_slice[2]);
+            return false;
+        }
+    }
+    if (im->raw_scan_size <= 0 || im->raw_scan_offset + im->raw_scan_size > in->size)
+    {
+        printf("Error in parseHeaders(): the raw scan lies outside of the file\n");
+        return false;
+    }
+    return true;
+}
+
+// Camera models whose difference values are corrected by default, see SeamModel. None is confirmed yet, the correction
+// has to be asked for with --seam-correct until a model is added here.
+static const SeamModel seamModels [] =
+{
+    { NULL, 1, 2 }
+};
+
+// The layout to correct the difference values of im with, NULL for none
+const SeamModel * seamModel(const ImData & im, int seamCorrect)
+{
+    static const SeamModel forced = { "", 1, 2 }; // Every other row from the second, where the correction was first seen
+
+    if (seamCorrect == 0)
+        return NULL;
+    for (int i = 0; seamModels[i].model; i++)
+    {
+        if (strcmp(seamModels[i].model, im.model) == 0)
+            return &seamModels[i];
+    }
+    return seamCorrect > 0 ? &forced : NULL;
+}
+
+// Q14 weights of the cubic through the same colour samples two and one before a run of 4 and one and two after it,
+// at the first and the second sample of that colour in the run
+static const int16_t seamWeights [2][4] = { { -4915, 16384, 8192, -3277 }, { -3277, 8192, 16384, -4915 } };
+
+inline int seamValue(int a, int b, int c, int d, const int16_t * w)
+{
+    int v = (w[0]*a + w[1]*b + w[2]*c + w[3]*d + (1 << 13)) >> 14;
+    return v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+}
+
+// Replaces the first 4 difference values of the rows of the seam layout among the scan rows firstRow to
+// firstRow + numRows - 1, which start at rows, and returns the number of rows corrected. The taps are fixed offsets from
+// the start of a row, the previous row ends right before it in scan order (also before rows when firstRow > 0), so 4
+// rows are interpolated at once with SSE2, each lane a row. The difference values fit 16 bits, the weights are applied
+// with madd_epi16 to pairs of taps and rounded, so the vector and the scalar rows come out the same.
+template <typename T>
+int correctSeams(T * rows, int width, int firstRow, int numRows, const SeamModel & seam)
+{
+    int first = seam.firstRow > 0 ? seam.firstRow : seam.firstRow + seam.rowStep; // Row 0 has no row before it
+    if (width < 8 || seam.rowStep < 1 || first < 1)
+        return 0;
+    if (first < firstRow)
+        first += (firstRow - first + seam.rowStep - 1)/seam.rowStep*seam.rowStep;
+    const int endRow = firstRow + numRows;
+
+    // Offsets from the start of the row of the taps of each corrected sample
+    static const int taps [4][4] = { { -4, -2, 4, 6 }, { -3, -1, 5, 7 }, { -4, -2, 4, 6 }, { -3, -1, 5, 7 } };
+
+    int corrected = 0;
+    int r = first;
+#ifdef __SSE2__
+    for (; r + 3*seam.rowStep < endRow; r += 4*seam.rowStep)
+    {
+        T * at [4];
+        for (int n = 0; n < 4; n++)
+            at[n] = rows + long(r - firstRow + n*seam.rowStep)*width;
+
+        __m128i out [4];
+        for (int k = 0; k < 4; k++)
+        {
+            const int * t = taps[k];
+            const int16_t * w = seamWeights[k >> 1];
+            __m128i ab = _mm_setr_epi16(int16_t(at[0][t[0]]), int16_t(at[0][t[1]]), int16_t(at[1][t[0]]), int16_t(at[1][t[1]]),
+                                        int16_t(at[2][t[0]]), int16_t(at[2][t[1]]), int16_t(at[3][t[0]]), int16_t(at[3][t[1]]));
+            __m128i cd = _mm_setr_epi16(int16_t(at[0][t[2]]), int16_t(at[0][t[3]]), int16_t(at[1][t[2]]), int16_t(at[1][t[3]]),
+                                        int16_t(at[2][t[2]]), int16_t(at[2][t[3]]), int16_t(at[3][t[2]]), int16_t(at[3][t[3]]));
+            __m128i sum = _mm_add_epi32(_mm_madd_epi16(ab, _mm_set1_epi32((uint16_t(w[1]) << 16) | uint16_t(w[0]))),
+                                        _mm_madd_epi16(cd, _mm_set1_epi32((uint16_t(w[3]) << 16) | uint16_t(w[2]))));
+            out[k] = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << 13)), 14);
+        }
+
+        // Rows 0, 1 in the first vector and 2, 3 in the second, samples 0 and 1 of both rows before samples 2 and 3
+        int16_t v [2][8];
+        _mm_storeu_si128((__m128i *) v[0], _mm_packs_epi32(_mm_unpacklo_epi32(out[0], out[1]), _mm_unpacklo_epi32(out[2], out[3])));
+        _mm_storeu_si128((__m128i *) v[1], _mm_packs_epi32(_mm_unpackhi_epi32(out[0], out[1]), _mm_unpackhi_epi32(out[2], out[3])));
+        for (int n = 0; n < 4; n++)
+        {
+            const int16_t * src = v[n >> 1] + (n & 1)*2;
+            at[n][0] = src[0];
+            at[n][1] = src[1];
+            at[n][2] = src[4];
+            at[n][3] = src[5];
+        }
+        corrected += 4;
+    }
+#endif
+    for (; r < endRow; r += seam.rowStep)
+    {
+        T * row = rows + long(r - firstRow)*width;
+        int v [4];
+        for (int k = 0; k < 4; k++)
+        {
+            const int * t = taps[k];
+            v[k] = seamValue(int16_t(row[t[0]]), int16_t(row[t[1]]), int16_t(row[t[2]]), int16_t(row[t[3]]), seamWeights[k >> 1]);
+        }
+        for (int k = 0; k < 4; k++)
+            row[k] = v[k];
+        corrected++;
+    }
+    return corrected;
+}
+
+// What becomes of the start of the scan rows firstRow to firstRow + numRows - 1 at rows, in the full frame and in the
+// bands alike. The first value of every other row, from the first, was never kept and stays 0 in the output, and the
+// seam correction, when there is one, needs the end of the row before rows as correctSeams says. Returns the number of
+// rows corrected.
+template <typename T>
+int fixRowStarts(T * rows, int width, int firstRow, int numRows, const SeamModel * seam)
+{
+    for (int r = firstRow & 1; r < numRows; r += 2)
+        rows[long(r)*width] = 0;
+    return seam ? correctSeams(rows, width, firstRow, numRows, *seam) : 0;
+}
+
+int getDiffValue(uint16_t code, int len)
+{
+    if (len == 0)
+        return 0;
+    if (len == 16)
+        return 32768;
+    return (code >= (1 << (len - 1)) ? code : (code - (1 << len) + 1)) ;
+}
+
+// T is int or int16_t, the difference values of up to 15 bits fit either
+template <typename T>
+void getDiffValues(T * diffOut, ImData im, DecodeOptions opts)
+{
+    // Retrieve huffman codes
+    uint16_t codes [HUFF_MAX_VALUES];
+    huffCodes(im.huffData, codes);
+
+    uint16_t minLen = 0;
+    uint16_t maxLen = 0;
+    uint16_t numCodes = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        numCodes += im.huffData[i];
+
+        if (minLen == 0 && im.huffData[i] != 0)
+            minLen = i + 1;
+
+        if (maxLen < i + 1 && im.huffData[i] != 0)
+            maxLen = i + 1;
+    }
+
+    uint16_t lenTab [numCodes];
+    uint16_t ccounter = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        uint16_t HD = im.huffData[i];
+        for (int n = 0; n < HD; n++)
+        {
+            lenTab[ccounter] = i+1;
+            ccounter ++;
+        }
+    }
+
+    HuffTable huffTable;
+    huffTable.build(im.huffData, im.huffValues);
+    if ((opts.legacyBits || opts.huffSearch) && !singleTable(im))
+        printf("Warning in getDiffValues(): the legacy decode only uses DHT table 0, the components on table 1 come out wrong\n");
+
+    for (int i = 0; !opts.quiet && i < 15; i++)
+    {
+        if (i == 0)
+            printf("did we get the codes?\n\n");
+        printBits(codes[i]); printf("\n");
+    }
+
+    ByteStream bstream;
+    if (opts.legacyBits || opts.huffSearch)
+    {
+        stats.start(STAGE_SCAN_LOAD);
+        loadScan(&bstream, im);
+        stats.stop(STAGE_SCAN_LOAD);
+        stats.count(stats.scanBytes, bstream.size);
+    }
+
+    int numDiffValues = im.sensor_width * im.sensor_height;
+
+    uint16_t remainder = 0;
+    uint16_t remLen = 0;
+    uint16_t CodeBitBuffer;
+
+
+    double decodeStart = monotonicSeconds();
+    double unstuffTime = 0;
+
+    if (opts.legacyBits || opts.huffSearch)
+    {
+        stats.start(STAGE_ENTROPY);
+        long badCodes = 0;
+        for (int i = 0; i < numDiffValues; i++)
+        {
+            uint16_t slidingBits, code, codeLen, counter, codeValue, tempBits;
+            tempBits = bstream.readBits(maxLen - remLen);
+            CodeBitBuffer = (remainder << (maxLen - remLen)) + tempBits;
+
+            slidingBits = CodeBitBuffer;
+            counter     = numCodes -1;
+        
+            bool foundCode = false;
+            if (opts.huffSearch)
+            {
+                for (int L = maxLen; L > minLen - 1 ; L--)
+                {
+                    for (int N = 0; N < im.huffData[L-1]; N++)
+                    {
+                        code = codes[counter];
+                        if (slidingBits == code)
+                        {
+                            foundCode = true;
+                            codeLen   = lenTab[counter];
+                            codeValue = im.huffValues[counter];
+                            break;
+                        }
+                        counter--;
+                    }
+                    slidingBits = slidingBits >> 1;
+
+                    if (foundCode)
+                        break;    
+                }
+            }
+            else
+            {
+                int len, value;
+                foundCode = huffTable.decode(CodeBitBuffer, maxLen, len, value);
+                if (foundCode)
+                {
+                    codeLen   = len;
+                    codeValue = value;
+                    code      = CodeBitBuffer >> (maxLen - codeLen);
+                }
+            }
+
+            if (!foundCode)
+                badCodes++;
+
+            uint16_t numNewBits, newBits, diffCode; 
+            int temp, diffValue;
+            int numDiffBits = codeValue == 16 ? 0 : codeValue; // Class 16 has no difference bits
+
+            remainder  = CodeBitBuffer - (code << (maxLen - codeLen) );
+            temp       = numDiffBits - (maxLen - codeLen); // WOOOPS be aware of overflow, we correct in line below!
+            numNewBits = temp > 0 ? temp : 0;
+
+            if ( numNewBits )
+            {
+                newBits = bstream.readBits(numNewBits);
+                diffCode = (remainder << numNewBits) + newBits;
+                remainder = 0;
+                remLen = 0;
+
+                if (i == numDiffValues -1 && !opts.quiet)
+                {
+                    printf("newBits = "); printBits(newBits); printf("\n\n");
+                }
+            }
+            else
+            {
+                diffCode = (remainder >> abs(temp));
+                remainder = remainder - (diffCode << abs(temp));
+                remLen = maxLen - codeLen - numDiffBits;
+            }
+
+             diffValue = getDiffValue(diffCode, codeValue);
+             diffOut[i] = diffValue;
+        }
+        stats.stop(STAGE_ENTROPY);
+
+        if (bstream.markers && !opts.quiet)
+            printf("Found %ld markers in the scan data\n", bstream.markers);
+        if (badCodes && !opts.quiet)
+            printf("We didn't find code %ld times :O :O \n\n", badCodes);
+
+        stats.count(stats.symbols, numDiffValues);
+        stats.count(stats.markers, bstream.markers);
+        stats.count(stats.badCodes, badCodes);
+        stats.count(stats.slowPathHits, huffTable.slowPathHits);
+    }
+    else
+    {
+        ScanDecoder scan;
+        scan.begin(im, opts);
+        unstuffTime = monotonicSeconds() - decodeStart;
+
+        if (scan.pump.markers && !opts.quiet)
+            printf("Found %ld markers in the scan data\n", scan.pump.markers);
+
+        stats.start(STAGE_ENTROPY);
+        int * row = new int [im.sensor_width];
+        for (int i = 0; i < numDiffValues; i += im.sensor_width)
+        {
+            scan.decode(row, im.sensor_width);
+            T * dst = diffOut + i;
+            for (int j = 0; j < im.sensor_width; j++)
+                dst[j] = row[j];
+        }
+        delete [] row;
+        stats.stop(STAGE_ENTROPY);
+
+        if (scan.badCodes && !opts.quiet)
+            printf("We didn't find code %ld times :O :O \n\n", scan.badCodes);
+
+        stats.count(stats.symbols, numDiffValues);
+        stats.count(stats.badCodes, scan.badCodes);
+        stats.count(stats.slowPathHits, scan.huffTable.slowPathHits + scan.huffTable1.slowPathHits);
+    }
+
+    double decodeTime = monotonicSeconds() - decodeStart;
+    if (!opts.quiet)
+        printf("Entropy decoded %ld bytes in %.3f ms (%.1f MB/s), of which unstuffing took %.3f ms\n", 
+           im.raw_scan_size, 1e3*decodeTime, im.raw_scan_size/decodeTime/1e6, 1e3*unstuffTime);
+
+    const SeamModel * seam = seamModel(im, opts.seamCorrect);
+    stats.start(STAGE_CORRECTION);
+    int rows = fixRowStarts(diffOut, im.sensor_width, 0, im.sensor_height, seam);
+    stats.stop(STAGE_CORRECTION);
+    if (seam && !opts.quiet)
+        printf("Corrected the seam at the start of %d rows\n", rows);
+}
+
+void Stats::start(int stage)
+{
+    if (level)
+        stageStart[stage] = monotonicSeconds();
+}
+
+void Stats::stop(int stage)
+{
+    if (level)
+        stageNanos[stage] += long(1e9*(monotonicSeconds() - stageStart[stage]));
+}
+
+void Stats::alloc(long bytes)
+{
+    if (level < 2)
+        return;
+    long now  = allocated += bytes;
+    long peak = peakAllocated;
+    while (now > peak && !peakAllocated.compare_exchange_weak(peak, now));
+}
+
+bool Stats::write(const char * fname, const char * input)
+{
+    FILE * out = fname ? fopen(fname, "w") : stdout;
+    if (out == NULL)
+    {
+        printf("Warning in Stats::write(): cannot open \"%s\"\n", fname);
+        return false;
+    }
+
+    static const char * stageNames [NUM_STAGES] = { "headers", "scan_load", "entropy", "correction", "unslice", "integrate", "demosaic", "convert", "output" };
+
+    fprintf(out, "{\"input\":\"");
+    for (const char * c = input; *c; c++)
+        fprintf(out, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    fprintf(out, "\",\"stage_ms\":{");
+    for (int i = 0; i < NUM_STAGES; i++)
+        fprintf(out, "%s\"%s\":%.3f", i ? "," : "", stageNames[i], 1e-6*stageNanos[i]);
+    fprintf(out, "}");
+
+    if (level > 1)
+    {
+        fprintf(out, ",\"counters\":{\"scan_bytes\":%ld,\"symbols\":%ld,\"slow_path_hits\":%ld,\"markers\":%ld,\"bad_codes\":%ld,\"peak_allocated_bytes\":%ld}",
+                long(scanBytes), long(symbols), long(slowPathHits), long(markers), long(badCodes), long(peakAllocated));
+    }
+    fprintf(out, "}\n");
+
+    if (fname)
+        fclose(out);
+    return true;
+}
+
+bool Arena::reserve(long bytes)
+{
+    release();
+    block = new (std::nothrow) uint8_t [bytes + ARENA_ALIGN];
+    if (block == NULL)
+        return false;
+    base = block + (-uintptr_t(block) & (ARENA_ALIGN - 1));
+    size = bytes;
+    used = peak = 0;
+    stats.alloc(size);
+    return true;
+}
+
+void Arena::release()
+{
+    if (block)
+        stats.release(size);
+    delete [] block;
+    block = base = NULL;
+    size = used = 0;
+}
+
+double monotonicSeconds()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+void loadScan(ByteStream * bstream, ImData & im)
+{
+    if (im.input->map)
+    {
+        // Zero copy, the scan is read straight from the mapping
+        bstream->mapBytes(im.input->map + im.raw_scan_offset, im.raw_scan_size);
+    }
+    else
+    {
+        fseek(im.input->file, im.raw_scan_offset, SEEK_SET);
+        bstream->loadBytes(im.input->file, im.raw_scan_size);
+        fseek(im.input->file, im.raw_scan_offset, SEEK_SET);
+    }
+}
+
+void ScanDecoder::setup(ImData & im)
+{
+    numComp   = im.num_comp >= 1 && im.num_comp <= 4 ? im.num_comp : 1;
+    lineWidth = im.samples_per_line*numComp;
+    for (int c = 0; c < 4; c++)
+        lineStart[c] = 1 << (im.precision - 1);
+
+    singleTable = ::singleTable(im);
+    bool useTable1 = false;
+    for (int c = 0; c < 4; c++)
+    {
+        compTable[c] = singleTable || c >= numComp ? 0 : im.compTable[c];
+        useTable1 |= compTable[c] == 1;
+    }
+
+    if (!tableBuilt || memcmp(tableData[0], im.huffData, 16) != 0 || memcmp(tableValues[0], im.huffValues, sizeof(tableValues[0])) != 0 ||
+        (useTable1 && (memcmp(tableData[1], im.huffData1, 16) != 0 || memcmp(tableValues[1], im.huffValues1, sizeof(tableValues[1])) != 0)))
+    {
+        huffTable.build(im.huffData, im.huffValues);
+        memcpy(tableData[0], im.huffData, 16);
+        memcpy(tableValues[0], im.huffValues, sizeof(tableValues[0]));
+        if (useTable1)
+        {
+            huffTable1.build(im.huffData1, im.huffValues1);
+            memcpy(tableData[1], im.huffData1, 16);
+            memcpy(tableValues[1], im.huffValues1, sizeof(tableValues[1]));
+        }
+        else
+            memset(tableData[1], 0xFF, 16); // Rebuild once table 1 is used
+        tableBuilt = true;
+    }
+    huffTable.slowPathHits  = 0;
+    huffTable1.slowPathHits = 0;
+    maxLen  = huffTable.maxLen;
+    maxLen1 = useTable1 ? huffTable1.maxLen : maxLen;
+    samplesDone = 0;
+
+    // The decode loops for the component count and the luma sampling of the file
+    if (isSraw(im))
+    {
+        lineWidth = im.samples_per_line*(im.lumaH*im.lumaV + 2);
+        mcuKernel = im.lumaV == 2 ? &ScanDecoder::decodeMcuRun<2, 2> : &ScanDecoder::decodeMcuRun<2, 1>;
+    }
+    switch (numComp)
+    {
+        case 2:  runKernel = &ScanDecoder::decodeRun<2>; diffKernel = &ScanDecoder::decodeDiffs<2>; break;
+        case 3:  runKernel = &ScanDecoder::decodeRun<3>; diffKernel = &ScanDecoder::decodeDiffs<3>; break;
+        case 4:  runKernel = &ScanDecoder::decodeRun<4>; diffKernel = &ScanDecoder::decodeDiffs<4>; break;
+        default: runKernel = &ScanDecoder::decodeRun<1>; diffKernel = &ScanDecoder::decodeDiffs<1>; break;
+    }
+}
+
+void ScanDecoder::begin(ImData & im, DecodeOptions opts)
+{
+    setup(im);
+
+    // Remove the stuffed zero bytes up front so that decode() never looks for markers
+    stats.start(STAGE_SCAN_LOAD);
+    if (im.input->map)
+        pump.load(im.input->map + im.raw_scan_offset, im.raw_scan_size, opts.simd);
+    else
+    {
+        fseek(im.input->file, im.raw_scan_offset, SEEK_SET);
+        pump.load(im.input->file, im.raw_scan_size, opts.simd);
+        fseek(im.input->file, im.raw_scan_offset, SEEK_SET);
+    }
+    badCodes = 0;
+    stats.stop(STAGE_SCAN_LOAD);
+    stats.count(stats.scanBytes, im.raw_scan_size);
+    stats.count(stats.markers, pump.markers);
+}
+
+void ScanDecoder::beginStream(ImData & im, DecodeOptions opts)
+{
+    // Like begin(), but the scan is unstuffed a chunk at a time as decode() gets to it, so whatever the size of the scan
+    // at most two chunks of it are held
+    setup(im);
+
+    stats.start(STAGE_SCAN_LOAD);
+    if (im.input->map)
+        pump.stream(im.input->map + im.raw_scan_offset, NULL, im.raw_scan_size, opts.simd);
+    else
+    {
+        fseek(im.input->file, im.raw_scan_offset, SEEK_SET);
+        pump.stream(NULL, im.input->file, im.raw_scan_size, opts.simd);
+    }
+    badCodes = 0;
+    stats.stop(STAGE_SCAN_LOAD);
+    stats.count(stats.scanBytes, im.raw_scan_size);
+}
+
+void ScanDecoder::share(const ScanDecoder & other)
+{
+    // Decodes the same unstuffed scan as other, for another thread
+    huffTable   = other.huffTable;
+    huffTable1  = other.huffTable1;
+    tableBuilt  = false;
+    maxLen      = other.maxLen;
+    maxLen1     = other.maxLen1;
+    singleTable = other.singleTable;
+    memcpy(compTable, other.compTable, sizeof(compTable));
+    runKernel   = other.runKernel;
+    diffKernel  = other.diffKernel;
+    mcuKernel   = other.mcuKernel;
+    numComp     = other.numComp;
+    lineWidth   = other.lineWidth;
+    samplesDone = 0;
+    badCodes    = 0;
+    checkpoints = NULL;
+    for (int c = 0; c < 4; c++)
+        lineStart[c] = other.lineStart[c];
+    pump.view(other.pump);
+}
+
+void ScanDecoder::decode(int * out, long count)
+{
+    // A streamed scan is topped up before each run. A sample takes at most 32 bits and a refill reads 8 bytes past its
+    // position, so a run of (bytes left - 16)/4 samples never reads past the bytes unstuffed so far.
+    while (count > 0)
+    {
+        long n = count;
+        if (pump.streamLeft > 0 || pump.streamCarry)
+        {
+            pump.topUp();
+            long fit = (pump.size - pump.byteLoc - 16)/4;
+            n = (pump.streamLeft > 0 || pump.streamCarry) && fit < count ? fit : count;
+        }
+        (this->*diffKernel)(out, n);
+        samplesDone += n;
+        out   += n;
+        count -= n;
+    }
+}
+
+void ScanDecoder::decodeLines(uint16_t * out, int numLines)
+{
+    // Lossless JPEG predictor 1: the previous sample of the same component on the line,
+    // and at the start of a line the sample above it. Sums wrap modulo 2^16 as in the standard.
+    for (int r = 0; r < numLines; r++)
+    {
+        if (checkpoints)
+            checkpoint(samplesDone/lineWidth + r);
+
+        uint16_t pred [4];
+        for (int c = 0; c < numComp; c++)
+            pred[c] = lineStart[c];
+        (this->*runKernel)(out, lineWidth, pred);
+
+        for (int c = 0; c < numComp; c++)
+            lineStart[c] = out[c];
+        out += lineWidth;
+    }
+    samplesDone += long(numLines)*lineWidth;
+}
+
+long decodePhotosites(uint16_t * photosites, ImData & im, DecodeOptions opts, ImageWriter * writer)
+{
+    // A decoder of its own on the file im was parsed from, nothing is kept for the next call
+    Cr2Decoder decoder;
+    decoder.opts = opts;
+    decoder.im   = im;
+    return decoder.decode(photosites, writer);
+}
+
+bool readAll(int fd, uint8_t * data, long size)
+{
+    while (size > 0)
+    {
+        long n = read(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool Cr2Decoder::open(const char * fname)
+{
+    // Read with plain system calls into the buffer of the last file, no FILE or mapping is set up per file
+    close();
+    int fd = ::open(fname, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    long size = st.st_size;
+    if (fileCapacity < size)
+    {
+        delete [] fileBytes;
+        stats.release(fileCapacity);
+        fileBytes = new uint8_t [size];
+        fileCapacity = size;
+        stats.alloc(size);
+    }
+    bool ok = readAll(fd, fileBytes, size);
+    ::close(fd);
+
+    return ok && open(fileBytes, size);
+}
+
+bool Cr2Decoder::open(const uint8_t * data, long size)
+{
+    close();
+    input.open(data, size);
+    im = ImData();
+    im.input = &input;
+    return parseHeaders(&im, false);
+}
+
+void Cr2Decoder::close()
+{
+    // The buffers stay for the next file
+    input.close();
+    im = ImData();
+}
+
+Cr2Decoder::~Cr2Decoder()
+{
+    delete [] fileBytes;
+    delete [] scanValues;
+    delete [] planes;
+    stats.release(fileCapacity + (scanCapacity + planesCapacity)*sizeof(uint16_t));
+}
+
+long Cr2Decoder::decode(uint16_t * photosites, ImageWriter * writer)
+{
+    // The predictor is applied while decoding, so the scan comes out as final sensor values
+    if (im.input == NULL || im.sensor_width == 0 || isSraw(im))
+        return -1;
+    scan.begin(im, opts);
+    long numSamples = long(im.num_lines)*scan.lineWidth;
+    long badCodes;
+
+    // Un-slicing and integration are fused into the entropy decoding unless the slices split a group of components
+    stats.start(STAGE_ENTROPY);
+    if (slicesAligned(im) && singleTable(im) && opts.scanThreads > 1)
+        badCodes = decodeFrameParallel(photosites, scan, im, opts.scanThreads, NULL);
+    else if (slicesAligned(im))
+    {
+        scan.decodeFrame(photosites, im, writer);
+        badCodes = scan.badCodes;
+    }
+    else
+    {
+        // Decode in scan order and gather afterwards
+        if (scanCapacity < numSamples)
+        {
+            delete [] scanValues;
+            stats.release(scanCapacity*sizeof(uint16_t));
+            scanValues = new uint16_t [numSamples];
+            scanCapacity = numSamples;
+            stats.alloc(numSamples*sizeof(uint16_t));
+        }
+        scan.decodeLines(scanValues, im.num_lines);
+        stats.stop(STAGE_ENTROPY);
+
+        stats.start(STAGE_UNSLICE);
+        unslice(photosites, scanValues, im);
+        stats.stop(STAGE_UNSLICE);
+
+        badCodes = scan.badCodes;
+        stats.start(STAGE_ENTROPY);
+    }
+    stats.stop(STAGE_ENTROPY);
+
+    // The sequential decode hands the rows to the writer as they are finished, the other paths all at the end
+    if (writer)
+    {
+        stats.start(STAGE_OUTPUT);
+        writer->rowsReady(photosites, im.sensor_height);
+        stats.stop(STAGE_OUTPUT);
+    }
+
+    stats.count(stats.symbols, numSamples);
+    stats.count(stats.badCodes, badCodes);
+    stats.count(stats.slowPathHits, scan.huffTable.slowPathHits + scan.huffTable1.slowPathHits);
+    return badCodes;
+}
+
+void decodeChunk(ScanDecoder * master, ScanChunk * chunk, long maxSymbols)
+{
+    ScanDecoder dec;
+    dec.share(*master);
+    dec.pump.seekBits(chunk->startBit);
+
+    long pos = chunk->startBit;
+    while (pos < chunk->endBit && long(chunk->diffs.size()) < maxSymbols)
+    {
+        if (chunk->starts.size() < SYNC_WINDOW)
+            chunk->starts.push_back(pos);
+        long bad = dec.badCodes;
+        chunk->diffs.push_back(int16_t(dec.decodeDiff()));
+        if (dec.badCodes != bad)
+            chunk->badAt.push_back(chunk->diffs.size() - 1);
+        pos = dec.pump.bitPosition();
+    }
+    chunk->stopBit = pos;
+    stats.count(stats.slowPathHits, dec.huffTable.slowPathHits);
+}
+
+void integrateLines(const int16_t * diffs, uint16_t * frame, ImData & im, const uint16_t * seeds, int firstLine, int numLines, ParallelTiming * timing, double start)
+{
+    // Same addressing as ScanDecoder::decodeFrame, starting from any line
+    int numComp   = im.num_comp;
+    int lineWidth = im.samples_per_line*numComp;
+    int count     = im.cr2_slice[0];
+    long sliceSize = long(im.cr2_slice[1])*im.sensor_height;
+
+    for (int r = firstLine; r < firstLine + numLines; r++)
+    {
+        long s = long(r)*lineWidth;
+        int slice = count && sliceSize ? (s / sliceSize < count ? s / sliceSize : count) : 0;
+        long local = s - slice*sliceSize;
+        int sliceWidth = slice < count ? im.cr2_slice[1] : im.cr2_slice[2];
+        int sliceRow = local / sliceWidth;
+        int col      = local % sliceWidth;
+        int sliceX0  = slice*im.cr2_slice[1];
+
+        uint16_t pred [4];
+        for (int c = 0; c < numComp; c++)
+            pred[c] = seeds[r*4 + c];
+
+        const int16_t * src = diffs + s;
+        for (int x = 0; x < lineWidth; )
+        {
+            int n = lineWidth - x < sliceWidth - col ? lineWidth - x : sliceWidth - col;
+            uint16_t * dst = frame + long(sliceRow)*im.sensor_width + sliceX0 + col;
+            for (int i = 0; i < n; i += numComp)
+            {
+                for (int c = 0; c < numComp; c++)
+                {
+                    pred[c] += src[i + c];
+                    dst[i + c] = pred[c];
+                }
+            }
+            src += n;
+            x   += n;
+            col += n;
+            if (col == sliceWidth)
+            {
+                col = 0;
+                if (++sliceRow == im.sensor_height)
+                {
+                    sliceRow = 0;
+                    sliceX0 += sliceWidth;
+                    slice++;
+                    sliceWidth = slice < count ? im.cr2_slice[1] : im.cr2_slice[2];
+                }
+            }
+        }
+
+        if (r == 0 && timing)
+            timing->firstRow = monotonicSeconds() - start;
+    }
+}
+
+long decodeFrameParallel(uint16_t * frame, ScanDecoder & scan, ImData & im, int numThreads, ParallelTiming * timing)
+{
+    // Needs slicesAligned(im), singleTable(im) and a scan decoder fresh from begin(). The chunks are decoded from guessed
+    // bit positions without knowing the component, so they can only use one table.
+    double start = monotonicSeconds();
+    long numSamples = long(im.num_lines)*scan.lineWidth;
+    long totalBits  = scan.pump.size*8;
+
+    // Speculative decode, each chunk starts at a guessed byte boundary
+    std::vector<ScanChunk> chunks(numThreads);
+    for (int t = 0; t < numThreads; t++)
+    {
+        chunks[t].startBit = (scan.pump.size*t/numThreads)*8;
+        chunks[t].endBit   = t + 1 < numThreads ? (scan.pump.size*(t + 1)/numThreads)*8 : totalBits;
+    }
+    std::vector<std::thread> workers;
+    for (int t = 0; t < numThreads; t++)
+        workers.push_back(std::thread(decodeChunk, &scan, &chunks[t], numSamples));
+    for (int t = 0; t < numThreads; t++)
+        workers[t].join();
+
+    // Stitch, the true stream enters each chunk at the stop of the previous one. From the first symbol start
+    // the two have in common on, the chunk's speculative decode is the true one.
+    int16_t * diffs = new int16_t [numSamples];
+    long n = 0;
+    long resync = 0;
+    long badCodes = 0;
+    long entry = 0;
+    for (int t = 0; t < numThreads && n < numSamples; t++)
+    {
+        ScanChunk & chunk = chunks[t];
+        std::vector<long> & starts = chunk.starts;
+        size_t j = std::lower_bound(starts.begin(), starts.end(), entry) - starts.begin();
+        bool synced = j < starts.size() && starts[j] == entry;
+
+        if (!synced)
+        {
+            ScanDecoder fix;
+            fix.share(scan);
+            fix.pump.seekBits(entry);
+            long pos = entry;
+            while (!synced && pos < chunk.endBit && n < numSamples)
+            {
+                diffs[n++] = int16_t(fix.decodeDiff());
+                pos = fix.pump.bitPosition();
+                resync++;
+                while (j < starts.size() && starts[j] < pos)
+                    j++;
+                synced = j < starts.size() && starts[j] == pos;
+            }
+            badCodes += fix.badCodes;
+            entry = pos;
+        }
+
+        if (synced)
+        {
+            long m = long(chunk.diffs.size()) - long(j);
+            if (m > numSamples - n)
+                m = numSamples - n;
+            memcpy(diffs + n, &chunk.diffs[j], m*sizeof(int16_t));
+            n += m;
+
+            // Only the codes missed from the sync point on belong to the true stream
+            badCodes += std::lower_bound(chunk.badAt.begin(), chunk.badAt.end(), long(j) + m) - 
+                        std::lower_bound(chunk.badAt.begin(), chunk.badAt.end(), long(j));
+            entry = chunk.stopBit;
+        }
+        std::vector<int16_t>().swap(chunk.diffs);
+    }
+    if (n < numSamples)
+        memset(diffs + n, 0, (numSamples - n)*sizeof(int16_t));
+
+    // Predictor fix-up, the first samples of each line only depend on the lines above,
+    // after that the lines are integrated in parallel
+    uint16_t * seeds = new uint16_t [4*im.num_lines];
+    for (int c = 0; c < scan.numComp; c++)
+        seeds[c] = scan.lineStart[c];
+    for (int r = 1; r < im.num_lines; r++)
+    {
+        for (int c = 0; c < scan.numComp; c++)
+            seeds[4*r + c] = seeds[4*(r - 1) + c] + diffs[long(r - 1)*scan.lineWidth + c];
+    }
+
+    workers.clear();
+    for (int t = 0; t < numThreads; t++)
+    {
+        int first = im.num_lines*t/numThreads;
+        int last  = im.num_lines*(t + 1)/numThreads;
+        workers.push_back(std::thread(integrateLines, diffs, frame, std::ref(im), seeds, first, last - first, timing, start));
+    }
+    for (int t = 0; t < numThreads; t++)
+        workers[t].join();
+
+    delete [] diffs;
+    delete [] seeds;
+
+    if (timing)
+    {
+        timing->lastRow = monotonicSeconds() - start;
+        timing->resyncSymbols = resync;
+    }
+    return badCodes;
+}
+
+bool slicesAligned(ImData & im)
+{
+    int n = im.num_comp;
+    return (im.cr2_slice[0] == 0 || im.cr2_slice[1] % n == 0) && im.cr2_slice[2] % n == 0;
+}
+
+bool singleTable(const ImData & im)
+{
+    // Every component decodes with the codes of DHT table 0, either it is the only table used or table 1 is the same
+    bool same = memcmp(im.huffData, im.huffData1, 16) == 0 && memcmp(im.huffValues, im.huffValues1, sizeof(im.huffValues)) == 0;
+    for (int c = 0; c < im.num_comp && c < 4; c++)
+    {
+        if (im.compTable[c] != 0 && !same)
+            return false;
+    }
+    return true;
+}
+
+void ScanDecoder::decodeFrame(uint16_t * frame, ImData & im, ImageWriter * writer)
+{
+    // Same as decodeLines followed by unslice, but every sample is written straight to its place in the sensor frame.
+    // The scan runs through the slices one after the other, [count, width, lastWidth] from CR2_SLICE,
+    // so a scan line is cut into runs that each fill the rest of a slice row. Needs slicesAligned().
+    // A frame row is final once its row of the last slice is, from then on it is handed to the writer if there is one.
+    int slice = 0, sliceX0 = 0, sliceRow = 0, col = 0;
+    int sliceWidth = im.cr2_slice[0] ? im.cr2_slice[1] : im.cr2_slice[2];
+    uint16_t * rowStart = frame;
+
+    for (int r = 0; r < im.num_lines; r++)
+    {
+        if (checkpoints)
+            checkpoint(r);
+
+        uint16_t pred [4];
+        for (int c = 0; c < numComp; c++)
+            pred[c] = lineStart[c];
+
+        for (int x = 0; x < lineWidth; )
+        {
+            int n = lineWidth - x < sliceWidth - col ? lineWidth - x : sliceWidth - col;
+            uint16_t * dst = rowStart + col;
+            (this->*runKernel)(dst, n, pred);
+
+            if (x == 0)
+            {
+                for (int c = 0; c < numComp; c++)
+                    lineStart[c] = dst[c];
+            }
+
+            x   += n;
+            col += n;
+            if (col == sliceWidth)
+            {
+                col = 0;
+                if (writer && slice == im.cr2_slice[0])
+                    writer->rowsReady(frame, sliceRow + 1);
+                if (++sliceRow == im.sensor_height)
+                {
+                    sliceRow = 0;
+                    sliceX0 += sliceWidth;
+                    slice++;
+                    sliceWidth = slice < im.cr2_slice[0] ? im.cr2_slice[1] : im.cr2_slice[2];
+                }
+                rowStart = frame + long(sliceRow)*im.sensor_width + sliceX0;
+            }
+        }
+    }
+    samplesDone += long(im.num_lines)*lineWidth;
+}
+
+void scanSweep(ImData & im, DecodeOptions opts)
+{
+    if (!slicesAligned(im) || !singleTable(im))
+    {
+        printf("The slices or the DHT tables of this file do not allow a parallel decode\n");
+        return;
+    }
+
+    long frameSize = long(im.sensor_width)*im.sensor_height;
+    uint16_t * reference = new uint16_t [frameSize];
+    uint16_t * frame     = new uint16_t [frameSize];
+
+    ScanDecoder scan;
+    scan.begin(im, opts);
+    double start = monotonicSeconds();
+    scan.decodeFrame(reference, im, NULL);
+    printf("%8s %14s %14s %10s %8s\n", "threads", "first row ms", "last row ms", "resync", "match");
+    printf("%8s %14s %14.3f %10s %8s\n", "seq", "", 1e3*(monotonicSeconds() - start), "", "");
+
+    // A match is the same frame and the same number of missed codes
+    int maxThreads = opts.scanThreads > 1 ? opts.scanThreads : 1;
+    for (int t = 1; t <= maxThreads; t++)
+    {
+        ScanDecoder fresh;
+        fresh.share(scan);
+        for (int c = 0; c < 4; c++)
+            fresh.lineStart[c] = 1 << (im.precision - 1);
+
+        ParallelTiming timing;
+        long badCodes = decodeFrameParallel(frame, fresh, im, t, &timing);
+        bool match = memcmp(frame, reference, frameSize*sizeof(uint16_t)) == 0 && badCodes == scan.badCodes;
+        printf("%8d %14.3f %14.3f %10ld %8s\n", t, 1e3*timing.firstRow, 1e3*timing.lastRow, timing.resyncSymbols, match ? "yes" : "NO");
+    }
+
+    // The same with 8 bytes in the middle of the scan set to 0xFF, which no code of a lossless JPEG table is made of
+    long at = scan.pump.size/2 < scan.pump.size - 8 ? scan.pump.size/2 : 0;
+    memset(scan.pump.bytes + at, 0xFF, scan.pump.size < 8 ? scan.pump.size : 8);
+    ScanDecoder serial;
+    serial.share(scan);
+    for (int c = 0; c < 4; c++)
+        serial.lineStart[c] = 1 << (im.precision - 1);
+    serial.decodeFrame(reference, im, NULL);
+    for (int t = 2; t <= maxThreads; t++)
+    {
+        ScanDecoder fresh;
+        fresh.share(scan);
+        for (int c = 0; c < 4; c++)
+            fresh.lineStart[c] = 1 << (im.precision - 1);
+        long badCodes = decodeFrameParallel(frame, fresh, im, t, NULL);
+        bool match = memcmp(frame, reference, frameSize*sizeof(uint16_t)) == 0 && badCodes == serial.badCodes;
+        printf("%8d threads on a corrupted scan: %ld missed codes against %ld sequentially, match %s\n", t, badCodes, serial.badCodes, match ? "yes" : "NO");
+    }
+
+    delete [] reference;
+    delete [] frame;
+}
+
+// ==================================================================================================================================================================================================
+// Checkpoint index and region decoding
+// ==================================================================================================================================================================================================
+
+bool ScanIndex::read(const char * fname, ImData & im, long inputSize, long inputTime)
+{
+    FILE * fp = fopen(fname, "rb");
+    if (fp == NULL)
+        return false;
+
+    char magic [8];
+    int64_t header [4];
+    int32_t counts [2];
+    bool ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, SCAN_INDEX_MAGIC, 8) == 0 &&
+              fread(header, sizeof(int64_t), 4, fp) == 4 && fread(counts, sizeof(int32_t), 2, fp) == 2;
+    ok = ok && header[0] == inputSize && header[1] == inputTime && header[2] == im.raw_scan_offset && header[3] == im.raw_scan_size && counts[0] > 0;
+    if (!ok)
+    {
+        fclose(fp);
+        return false;
+    }
+    fileSize   = header[0];
+    fileTime   = header[1];
+    scanOffset = header[2];
+    scanSize   = header[3];
+    lines      = counts[0];
+
+    checkpoints.resize(counts[1]);
+    for (int i = 0; i < counts[1] && ok; i++)
+    {
+        int64_t offset;
+        uint8_t bit;
+        ok = fread(&offset, sizeof(offset), 1, fp) == 1 && fread(&bit, 1, 1, fp) == 1 && 
+             fread(checkpoints[i].seeds, sizeof(uint16_t), 4, fp) == 4;
+        checkpoints[i].stuffedOffset = offset;
+        checkpoints[i].bit    = bit;
+        checkpoints[i].bitPos = -1;
+    }
+    fclose(fp);
+    return ok && long(checkpoints.size()) == (im.num_lines + lines - 1)/lines;
+}
+
+bool ScanIndex::write(const char * fname)
+{
+    FILE * fp = fopen(fname, "wb");
+    if (fp == NULL)
+    {
+        printf("Warning in ScanIndex::write(): cannot write \"%s\"\n", fname);
+        return false;
+    }
+
+    int64_t header [4] = { fileSize, fileTime, scanOffset, scanSize };
+    int32_t counts [2] = { lines, int32_t(checkpoints.size()) };
+    fwrite(SCAN_INDEX_MAGIC, 1, 8, fp);
+    fwrite(header, sizeof(int64_t), 4, fp);
+    fwrite(counts, sizeof(int32_t), 2, fp);
+    for (size_t i = 0; i < checkpoints.size(); i++)
+    {
+        int64_t offset = checkpoints[i].stuffedOffset;
+        uint8_t bit    = checkpoints[i].bit;
+        fwrite(&offset, sizeof(offset), 1, fp);
+        fwrite(&bit, 1, 1, fp);
+        fwrite(checkpoints[i].seeds, sizeof(uint16_t), 4, fp);
+    }
+    bool ok = ferror(fp) == 0;
+    fclose(fp);
+    return ok;
+}
+
+void stuffedOffsets(const uint8_t * stuffed, long size, std::vector<ScanCheckpoint> & checkpoints)
+{
+    // Walks the stuffed scan with the rule of unstuffScalar, counting the bytes that are kept, and notes where
+    // the byte of each checkpoint bit is. The checkpoints are in scan order.
+    long o = 0;
+    size_t k = 0;
+    for (long i = 0; i < size && k < checkpoints.size(); i++, o++)
+    {
+        while (k < checkpoints.size() && (checkpoints[k].bitPos >> 3) == o)
+        {
+            checkpoints[k].stuffedOffset = i;
+            checkpoints[k].bit = checkpoints[k].bitPos & 7;
+            k++;
+        }
+        if (stuffed[i] == 0xFF && i + 1 < size && stuffed[i + 1] == 0x00)
+            i++;
+    }
+    for (; k < checkpoints.size(); k++)
+    {
+        checkpoints[k].stuffedOffset = size;
+        checkpoints[k].bit = 0;
+    }
+}
+
+void scatterLines(const uint16_t * samples, long first, long count, ImData & im, uint16_t * roi, int rx, int ry, int rw, int rh)
+{
+    // Places scan samples [first, first + count) in the region, the scan holds the slices one after the other
+    // as decodeFrame has it. Runs of a slice row outside the region are skipped.
+    long sliceSize = long(im.cr2_slice[1])*im.sensor_height;
+    long p = first, end = first + count;
+    while (p < end)
+    {
+        int k = im.cr2_slice[0] ? p/sliceSize : 0;
+        k = k < im.cr2_slice[0] ? k : im.cr2_slice[0];
+        int w = k < im.cr2_slice[0] ? im.cr2_slice[1] : im.cr2_slice[2];
+        long local = p - k*sliceSize;
+        int row = local/w;
+        int col = local%w;
+        int n   = end - p < w - col ? end - p : w - col;
+
+        int x0 = k*im.cr2_slice[1] + col;
+        int a  = x0 > rx ? x0 : rx;
+        int b  = x0 + n < rx + rw ? x0 + n : rx + rw;
+        if (row >= ry && row < ry + rh && a < b)
+            memcpy(roi + long(row - ry)*rw + (a - rx), samples + (p - first) + (a - x0), (b - a)*sizeof(uint16_t));
+        p += n;
+    }
+}
+
+void roiWorker(RoiJob * job)
+{
+    // Each interval is unstuffed from its checkpoint to the byte of the next one, and decoded from the seeds
+    ImData & im = *job->im;
+    ScanIndex & index = *job->index;
+    ScanDecoder scan;
+    scan.setup(im);
+    uint16_t * lines = new uint16_t [long(index.lines)*scan.lineWidth];
+
+    while (true)
+    {
+        int i = job->next++;
+        if (i >= int(job->intervals.size()))
+            break;
+
+        int c = job->intervals[i];
+        const ScanCheckpoint & cp = index.checkpoints[c];
+        long end = c + 1 < int(index.checkpoints.size()) ? index.checkpoints[c + 1].stuffedOffset + 1 : index.scanSize;
+        end = end < index.scanSize ? end : index.scanSize;
+        int firstLine = c*index.lines;
+        int numLines  = im.num_lines - firstLine < index.lines ? im.num_lines - firstLine : index.lines;
+
+        scan.pump.load(job->scan + cp.stuffedOffset, end - cp.stuffedOffset, job->simd);
+        scan.pump.seekBits(cp.bit);
+        memcpy(scan.lineStart, cp.seeds, sizeof(scan.lineStart));
+        scan.badCodes = 0;
+        scan.decodeLines(lines, numLines);
+        job->badCodes += scan.badCodes;
+
+        scatterLines(lines, long(firstLine)*scan.lineWidth, long(numLines)*scan.lineWidth, im, job->roi, job->x, job->y, job->width, job->height);
+    }
+    delete [] lines;
+}
+
+bool buildScanIndex(ScanIndex & index, ImData & im, long inputSize, long inputTime, uint16_t * frame, DecodeOptions opts)
+{
+    // A sequential decode of the whole frame that notes the checkpoints on the way
+    ScanDecoder scan;
+    scan.begin(im, opts);
+    scan.checkpoints     = &index.checkpoints;
+    scan.checkpointLines = index.lines;
+    if (slicesAligned(im))
+        scan.decodeFrame(frame, im, NULL);
+    else
+    {
+        uint16_t * scanValues = new uint16_t [long(im.num_lines)*scan.lineWidth];
+        scan.decodeLines(scanValues, im.num_lines);
+        unslice(frame, scanValues, im);
+        delete [] scanValues;
+    }
+    if (scan.badCodes)
+        printf("Warning in buildScanIndex(): %ld undecodable codes\n", scan.badCodes);
+
+    stuffedOffsets(im.input->map + im.raw_scan_offset, im.raw_scan_size, index.checkpoints);
+    index.fileSize   = inputSize;
+    index.fileTime   = inputTime;
+    index.scanOffset = im.raw_scan_offset;
+    index.scanSize   = im.raw_scan_size;
+    return scan.badCodes == 0;
+}
+
+int runRoi(const char * in_fname, const char * out_fname, DecodeOptions opts)
+{
+    // The scan is read from the mapping, so only the pages of the intervals that are decoded are touched
+    InputFile input;
+    ImData im;
+    im.input = &input;
+    if (!input.open(in_fname, true) || input.map == NULL || !parseHeaders(&im, false) || isSraw(im))
+    {
+        printf("The file \"%s\" cannot be mapped and decoded, or is an sRAW/mRAW file that is only decoded whole!\n", in_fname);
+        input.close();
+        return 1;
+    }
+
+    int x = opts.roi[0], y = opts.roi[1], w = opts.roi[2], h = opts.roi[3];
+    if (x < 0 || y < 0 || x + w > im.sensor_width || y + h > im.sensor_height)
+    {
+        printf("The region %dx%d at (%d,%d) is not inside the %dx%d frame!\n", w, h, x, y, im.sensor_width, im.sensor_height);
+        input.close();
+        return 1;
+    }
+
+    std::string idx_fname = std::string(in_fname) + ".idx";
+    uint16_t * roi = new uint16_t [long(w)*h];
+    ScanIndex index;
+    double start = monotonicSeconds();
+    struct stat st;
+    long inputTime = stat(in_fname, &st) == 0 ? long(st.st_mtim.tv_sec)*1000000000L + st.st_mtim.tv_nsec : 0;
+
+    if (!index.read(idx_fname.c_str(), im, input.size, inputTime))
+    {
+        // First decode of this file, the index is built from a full decode and the region cropped from it
+        index = ScanIndex();
+        index.lines = opts.checkpointLines > 0 ? opts.checkpointLines : 64;
+        uint16_t * frame = new uint16_t [long(im.sensor_width)*im.sensor_height];
+        bool decoded = buildScanIndex(index, im, input.size, inputTime, frame, opts);
+        for (int i = 0; i < h; i++)
+            memcpy(roi + long(i)*w, frame + long(y + i)*im.sensor_width + x, w*sizeof(uint16_t));
+        delete [] frame;
+
+        // The checkpoints of a scan with undecodable codes are not kept, every region of it is decoded from the whole frame
+        if (decoded)
+        {
+            bool written = index.write(idx_fname.c_str());
+            printf("Decoded the whole frame and %s %d checkpoints every %d scan lines to \"%s\" in %.3f ms\n", 
+                   written ? "wrote" : "could not write", int(index.checkpoints.size()), index.lines, idx_fname.c_str(), 1e3*(monotonicSeconds() - start));
+        }
+        else
+        {
+            remove(idx_fname.c_str());
+            printf("Decoded the whole frame in %.3f ms, the scan has undecodable codes so no index was written\n", 1e3*(monotonicSeconds() - start));
+        }
+    }
+    else
+    {
+        // The checkpoint intervals that hold the slice rows of the region, for every slice the region overlaps
+        RoiJob job;
+        job.im     = &im;
+        job.index  = &index;
+        job.scan   = input.map + im.raw_scan_offset;
+        job.simd   = opts.simd;
+        job.x = x, job.y = y, job.width = w, job.height = h;
+        job.roi    = roi;
+
+        ScanDecoder probe;
+        probe.setup(im);
+        std::vector<bool> needed (index.checkpoints.size(), false);
+        long sliceSize = long(im.cr2_slice[1])*im.sensor_height;
+        int sliceX0 = 0;
+        for (int k = 0; k <= im.cr2_slice[0]; k++)
+        {
+            int sw = k < im.cr2_slice[0] ? im.cr2_slice[1] : im.cr2_slice[2];
+            if (sliceX0 < x + w && sliceX0 + sw > x)
+            {
+                long firstLine = (k*sliceSize + long(y)*sw)/probe.lineWidth;
+                long lastLine  = (k*sliceSize + long(y + h)*sw - 1)/probe.lineWidth;
+                for (long c = firstLine/index.lines; c <= lastLine/index.lines; c++)
+                    needed[c] = true;
+            }
+            sliceX0 += sw;
+        }
+        for (size_t c = 0; c < needed.size(); c++)
+        {
+            if (needed[c])
+                job.intervals.push_back(c);
+        }
+
+        int numThreads = opts.threads > 0 ? opts.threads : std::thread::hardware_concurrency();
+        numThreads = numThreads < 1 ? 1 : numThreads;
+        numThreads = numThreads < int(job.intervals.size()) ? numThreads : int(job.intervals.size());
+        std::vector<std::thread> workers;
+        for (int t = 0; t < numThreads; t++)
+            workers.push_back(std::thread(roiWorker, &job));
+        for (int t = 0; t < numThreads; t++)
+            workers[t].join();
+
+        if (job.badCodes)
+            printf("Warning in runRoi(): %ld undecodable codes\n", long(job.badCodes));
+        printf("Decoded %d of %d checkpoint intervals (%d scan lines each) on %d threads in %.3f ms\n", 
+               int(job.intervals.size()), int(index.checkpoints.size()), index.lines, numThreads, 1e3*(monotonicSeconds() - start));
+    }
+    input.close();
+
+    ImageWriter writer;
+    int format = opts.format >= 0 ? opts.format : imageFormat(out_fname);
+    bool ok = writer.open(out_fname, format, w, h, 1, (1 << im.precision) - 1);
+    if (ok)
+    {
+        writer.writeRows(roi, h);
+        ok = writer.close();
+    }
+    delete [] roi;
+    printf("Wrote the %dx%d region at (%d,%d) to \"%s\"\n", w, h, x, y, out_fname);
+    return ok ? 0 : 1;
+}
+
+// ==================================================================================================================================================================================================
+// Binned preview decode
+// ==================================================================================================================================================================================================
+
+bool Binner::begin(ImData & im, int factor, bool gray, int bayerX, int bayerY, ImageWriter * writer)
+{
+    this->im      = &im;
+    this->factor  = factor;
+    this->bayerX  = bayerX;
+    this->bayerY  = bayerY;
+    this->writer  = writer;
+    channels = gray ? 1 : 3;
+    for (shift = 0; (1 << shift) < factor; shift++);
+
+    // A block may be cut by one slice boundary, not by two
+    int minSlice = im.cr2_slice[0] ? (im.cr2_slice[1] < im.cr2_slice[2] ? im.cr2_slice[1] : im.cr2_slice[2]) : im.cr2_slice[2];
+    if (factor < 2 || (1 << shift) != factor || factor > minSlice)
+    {
+        printf("Error in Binner::begin(): the factor %d is not a power of two from 2 to the slice width %d\n", factor, minSlice);
+        return false;
+    }
+
+    outWidth  = im.sensor_width >> shift;
+    outHeight = im.sensor_height >> shift;
+    out   = new uint16_t [long(outWidth)*outHeight*channels];
+    band  = new uint32_t [3*(outWidth + 1)];
+    carry = new uint32_t [3*long(im.cr2_slice[0] + 1)*outHeight];
+
+    slice = sliceX0 = row = col = 0;
+    sliceWidth = im.cr2_slice[0] ? im.cr2_slice[1] : im.cr2_slice[2];
+    startSlice();
+    return true;
+}
+
+Binner::~Binner()
+{
+    delete [] out;
+    delete [] band;
+    delete [] carry;
+}
+
+void Binner::startSlice()
+{
+    firstCol = sliceX0 >> shift;
+    lastCol  = (sliceX0 + sliceWidth - 1) >> shift;
+    lastCol  = lastCol < outWidth ? lastCol : outWidth - 1;
+}
+
+void Binner::startBand()
+{
+    if ((row >> shift) >= outHeight || firstCol > lastCol)
+        return;
+    memset(band + 3*firstCol, 0, 3*(lastCol - firstCol + 1)*sizeof(uint32_t));
+    if (sliceX0 & (factor - 1))
+    {
+        const uint32_t * cut = carry + 3*(long(slice - 1)*outHeight + (row >> shift));
+        for (int c = 0; c < 3; c++)
+            band[3*firstCol + c] += cut[c];
+    }
+}
+
+void Binner::finishBand()
+{
+    int r = row >> shift;
+    if (r >= outHeight || firstCol > lastCol)
+        return;
+
+    // The last block of the slice goes on with the next slice when the boundary cuts it
+    int end = sliceX0 + sliceWidth;
+    bool cut = slice < im->cr2_slice[0] && (end & (factor - 1)) && (end >> shift) < outWidth;
+    int last = cut ? lastCol - 1 : lastCol;
+    if (cut)
+        memcpy(carry + 3*(long(slice)*outHeight + r), band + 3*lastCol, 3*sizeof(uint32_t));
+
+    // A block holds factor*factor/4 red and blue and factor*factor/2 green photosites
+    uint32_t quarter = factor*factor/4;
+    uint16_t * dst = out + (long(r)*outWidth + firstCol)*channels;
+    for (int c = firstCol; c <= last; c++)
+    {
+        const uint32_t * sums = band + 3*c;
+        if (channels == 1)
+            *dst++ = (sums[0] + sums[1] + sums[2] + 2*quarter)/(4*quarter);
+        else
+        {
+            *dst++ = (sums[0] + quarter/2)/quarter;
+            *dst++ = (sums[1] + quarter)/(2*quarter);
+            *dst++ = (sums[2] + quarter/2)/quarter;
+        }
+    }
+
+    if (writer && slice == im->cr2_slice[0])
+        writer->rowsReady(out, r + 1);
+}
+
+void Binner::consume(const uint16_t * samples, long count)
+{
+    // The scan order runs of slice rows, as in decodeFrame
+    while (count > 0)
+    {
+        if (col == 0 && (row & (factor - 1)) == 0)
+            startBand();
+
+        int n = count < sliceWidth - col ? count : sliceWidth - col;
+        int x = sliceX0 + col;
+        int limit = (outWidth << shift) - x;
+        limit = limit < n ? limit : n;
+        if ((row >> shift) < outHeight && limit > 0)
+        {
+            // 0 red, 1 green, 2 blue for the even and the odd columns of this row
+            bool redRow = ((row ^ bayerY) & 1) == 0;
+            int chEven = redRow ? ((bayerX & 1) ? 1 : 0) : ((bayerX & 1) ? 2 : 1);
+            int chOdd  = redRow ? ((bayerX & 1) ? 0 : 1) : ((bayerX & 1) ? 1 : 2);
+            for (int j = 0; j < limit; j++)
+            {
+                int xx = x + j;
+                band[3*(xx >> shift) + ((xx & 1) ? chOdd : chEven)] += samples[j];
+            }
+        }
+
+        samples += n;
+        count   -= n;
+        col     += n;
+        if (col == sliceWidth)
+        {
+            col = 0;
+            if ((row & (factor - 1)) == factor - 1)
+                finishBand();
+            if (++row == im->sensor_height)
+            {
+                row = 0;
+                sliceX0 += sliceWidth;
+                slice++;
+                sliceWidth = slice < im->cr2_slice[0] ? im->cr2_slice[1] : im->cr2_slice[2];
+                startSlice();
+            }
+        }
+    }
+}
+
+int runBin(const char * in_fname, const char * out_fname, DecodeOptions opts)
+{
+    InputFile input;
+    ImData im;
+    im.input = &input;
+    if (!input.open(in_fname, opts.mmap) || !parseHeaders(&im, false) || isSraw(im))
+    {
+        printf("The file \"%s\" cannot be opened and decoded, or is an sRAW/mRAW file without a Bayer mosaic to bin!\n", in_fname);
+        input.close();
+        return 1;
+    }
+
+    double start = monotonicSeconds();
+    ImageWriter writer;
+    Binner binner;
+    int format = opts.format >= 0 ? opts.format : imageFormat(out_fname);
+    if (!binner.begin(im, opts.bin, opts.binGray, opts.bayerX, opts.bayerY, &writer) ||
+        !writer.open(out_fname, format, binner.outWidth, binner.outHeight, binner.channels, (1 << im.precision) - 1))
+    {
+        input.close();
+        return 1;
+    }
+
+    // One scan line of scratch, the predictor runs as in decodeLines
+    ScanDecoder scan;
+    scan.begin(im, opts);
+    uint16_t * line = new uint16_t [scan.lineWidth];
+    stats.start(STAGE_ENTROPY);
+    for (int i = 0; i < im.num_lines; i++)
+    {
+        scan.decodeLines(line, 1);
+        binner.consume(line, scan.lineWidth);
+    }
+    stats.stop(STAGE_ENTROPY);
+    delete [] line;
+    input.close();
+
+    writer.rowsReady(binner.out, binner.outHeight);
+    bool ok = writer.close();
+    if (scan.badCodes)
+        printf("Warning in runBin(): %ld undecodable codes\n", scan.badCodes);
+    printf("Wrote a %dx%d %s preview, 1/%d of %dx%d, in %.3f ms\n", binner.outWidth, binner.outHeight, binner.channels == 1 ? "gray" : "RGB", 
+           opts.bin, im.sensor_width, im.sensor_height, 1e3*(monotonicSeconds() - start));
+    if (stats.level)
+        stats.write(opts.statsFile, in_fname);
+    return ok ? 0 : 1;
+}
+
+// ==================================================================================================================================================================================================
+// Embedded preview extraction
+// ==================================================================================================================================================================================================
+
+bool parsePreviews(InputFile * in, PreviewInfo * pv)
+{
+    // IFD#0 holds the large JPEG, IFD#1 the thumbnail and IFD#2 the RGB image, each ends with the offset of the next one
+    *pv = PreviewInfo();
+
+    TIFF_HEADER tiff_header;
+    in->seek(0);
+    freadVar(&tiff_header, in);
+    if (tiff_header.id[0] != 'I' || tiff_header.id[1] != 'I' || tiff_header.version != 42)
+        return false;
+
+    uint32_t ifdOffset = tiff_header.offset;
+    for (int ifd = 0; ifd < 3 && ifdOffset != 0 && ifdOffset < in->size; ifd++)
+    {
+        in->seek(ifdOffset);
+        uint16_t num_IFD_entries = 0;
+        freadVar(&num_IFD_entries, in);
+        if (ifdOffset + 2 + 12*long(num_IFD_entries) + 4 > in->size)
+            return false;
+
+        long stripOffset = 0, stripSize = 0;
+        TIFF_TAG tiff_tag;
+        for (int i = 0; i < num_IFD_entries; i++)
+        {
+            freadVar(&tiff_tag, in);
+            if (tiff_tag.ID == STRIP_OFFSET)
+                stripOffset = tiff_tag.value;
+            if (tiff_tag.ID == STRIP_BYTE_COUNTS)
+                stripSize = tiff_tag.value;
+            if (tiff_tag.ID == JPEG_INTERCHANGE_FORMAT)
+                pv->thumb_offset = tiff_tag.value;
+            if (tiff_tag.ID == JPEG_INTERCHANGE_FORMAT_LENGTH)
+                pv->thumb_size = tiff_tag.value;
+            if (ifd == 2 && tiff_tag.ID == IMAGE_WIDTH)
+                pv->rgb_width = tiff_tag.value & 0xFFFF;
+            if (ifd == 2 && tiff_tag.ID == IMAGE_LENGTH)
+                pv->rgb_height = tiff_tag.value & 0xFFFF;
+            if (ifd == 2 && tiff_tag.ID == BITS_PER_SAMPLE)
+            {
+                // Three shorts do not fit in the tag, the first one is read from where it points
+                if (tiff_tag.values == 1)
+                    pv->rgb_bits = tiff_tag.value & 0xFFFF;
+                else
+                {
+                    long currentOffset = in->tell();
+                    uint16_t bits = 0;
+                    in->seek(tiff_tag.value);
+                    freadVar(&bits, in);
+                    in->seek(currentOffset);
+                    pv->rgb_bits = bits;
+                }
+            }
+        }
+        freadVar(&ifdOffset, in);
+
+        if (ifd == 0)
+            pv->jpeg_offset = stripOffset, pv->jpeg_size = stripSize;
+        if (ifd == 2)
+            pv->rgb_offset = stripOffset, pv->rgb_size = stripSize;
+    }
+
+    // Anything that does not lie within the file is dropped
+    if (pv->jpeg_offset <= 0 || pv->jpeg_size <= 0 || pv->jpeg_offset + pv->jpeg_size > in->size)
+        pv->jpeg_offset = pv->jpeg_size = 0;
+    if (pv->thumb_offset <= 0 || pv->thumb_size <= 0 || pv->thumb_offset + pv->thumb_size > in->size)
+        pv->thumb_offset = pv->thumb_size = 0;
+    long rgbBytes = long(pv->rgb_width)*pv->rgb_height*3*(pv->rgb_bits > 8 ? 2 : 1);
+    if (pv->rgb_offset <= 0 || rgbBytes == 0 || pv->rgb_size < rgbBytes || pv->rgb_offset + pv->rgb_size > in->size)
+        pv->rgb_offset = pv->rgb_size = 0;
+    return true;
+}
+
+bool writeRegion(const char * fname, const char * header, InputFile * in, long offset, long size, bool swap16)
+{
+    FILE * filep = fopen(fname, "wb");
+    if (filep == NULL)
+    {
+        printf("Warning in writeRegion(): cannot open \"%s\"\n", fname);
+        return false;
+    }
+
+    // A mapped region is written unbuffered, so the bytes go from the mapping to the file without an intermediate
+    // copy. The buffering has to be set before anything is written to the stream.
+    bool direct = in->map && !swap16;
+    if (direct)
+        setvbuf(filep, NULL, _IONBF, 0);
+
+    if (header)
+        fputs(header, filep);
+
+    long numWrites = 0;
+    if (direct)
+    {
+        numWrites = fwrite(in->map + offset, 1, size, filep);
+    }
+    else
+    {
+        uint8_t * bytes = new uint8_t [size];
+        in->seek(offset);
+        in->read(bytes, 1, size);
+        // 16 bit PPM is big endian, the TIFF data little endian
+        for (long i = 0; swap16 && i + 1 < size; i += 2)
+            std::swap(bytes[i], bytes[i + 1]);
+        numWrites = fwrite(bytes, 1, size, filep);
+        delete [] bytes;
+    }
+
+    fclose(filep);
+    if (numWrites != size)
+        printf("Warning in writeRegion(): short write to \"%s\"\n", fname);
+    return numWrites == size;
+}
+
+int extractPreviews(InputFile * in, const char * outPrefix, bool verbose)
+{
+    // Returns the number of images written, the raw IFD and the scan are never read
+    PreviewInfo pv;
+    if (!parsePreviews(in, &pv))
+    {
+        printf("Warning in extractPreviews(): not a little endian TIFF file\n");
+        return 0;
+    }
+
+    int numWritten = 0;
+    std::string prefix = outPrefix;
+
+    if (pv.jpeg_size)
+    {
+        numWritten += writeRegion((prefix + ".jpg").c_str(), NULL, in, pv.jpeg_offset, pv.jpeg_size, false);
+        if (verbose) printf("JPEG preview      : %ld bytes at %ld\n", pv.jpeg_size, pv.jpeg_offset);
+    }
+    if (pv.thumb_size)
+    {
+        numWritten += writeRegion((prefix + ".thumb.jpg").c_str(), NULL, in, pv.thumb_offset, pv.thumb_size, false);
+        if (verbose) printf("JPEG thumbnail    : %ld bytes at %ld\n", pv.thumb_size, pv.thumb_offset);
+    }
+    if (pv.rgb_size)
+    {
+        bool wide = pv.rgb_bits > 8;
+        char header [64];
+        snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", pv.rgb_width, pv.rgb_height, wide ? (1 << pv.rgb_bits) - 1 : 255);
+        long rgbBytes = long(pv.rgb_width)*pv.rgb_height*3*(wide ? 2 : 1);
+        numWritten += writeRegion((prefix + ".ppm").c_str(), header, in, pv.rgb_offset, rgbBytes, wide);
+        if (verbose) printf("RGB image         : %dx%d, %d bits at %ld\n", pv.rgb_width, pv.rgb_height, pv.rgb_bits, pv.rgb_offset);
+    }
+    return numWritten;
+}
+
+// ==================================================================================================================================================================================================
+// Batch decoding of many files on a thread pool
+// ==================================================================================================================================================================================================
+
+void InflightBudget::acquire(long bytes)
+{
+    // A file larger than the whole budget still goes through, on its own
+    std::unique_lock<std::mutex> lock(mutex);
+    while (used > 0 && used + bytes > limit)
+        freed.wait(lock);
+    used += bytes;
+}
+
+void InflightBudget::release(long bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    used -= bytes;
+    freed.notify_all();
+}
+
+void Prefetcher::start(const std::vector<std::string> & files, int depth, long maxBytes)
+{
+    this->files    = &files;
+    this->depth    = depth;
+    this->maxBytes = maxBytes;
+    ready.assign(files.size(), NULL);
+    reader = std::thread(&Prefetcher::readerLoop, this);
+}
+
+Prefetcher::~Prefetcher()
+{
+    if (reader.joinable())
+        reader.join();
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+        stats.release(pool[i]->capacity);
+        delete [] pool[i]->data;
+        delete pool[i];
+    }
+}
+
+void Prefetcher::readerLoop()
+{
+    for (size_t i = 0; i < files->size(); i++)
+    {
+        const char * fname = (*files)[i].c_str();
+        struct stat st;
+        long size = stat(fname, &st) == 0 ? st.st_size : 0;
+
+        // Wait for room in the queue, then take a free buffer, it grows when the file does not fit
+        PrefetchBuffer * buffer = NULL;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (ahead >= depth || (ahead > 0 && aheadBytes + size > maxBytes))
+                changed.wait(lock);
+            ahead++;
+            aheadBytes += size;
+            peakAhead      = ahead > peakAhead ? ahead : peakAhead;
+            peakAheadBytes = aheadBytes > peakAheadBytes ? aheadBytes : peakAheadBytes;
+            if (!pool.empty())
+            {
+                buffer = pool.back();
+                pool.pop_back();
+            }
+        }
+        if (buffer == NULL)
+            buffer = new PrefetchBuffer;
+        if (buffer->capacity < size)
+        {
+            stats.release(buffer->capacity);
+            delete [] buffer->data;
+            buffer->data = new uint8_t [size];
+            buffer->capacity = size;
+            stats.alloc(size);
+        }
+
+        double start = monotonicSeconds();
+        int fd = ::open(fname, O_RDONLY);
+        buffer->size = size;
+        buffer->ok = fd >= 0 && size > 0 && readAll(fd, buffer->data, size);
+        if (fd >= 0)
+            ::close(fd);
+        double elapsed = monotonicSeconds() - start;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        readTime += elapsed;
+        ready[i] = buffer;
+        changed.notify_all();
+    }
+}
+
+PrefetchBuffer * Prefetcher::take(long file)
+{
+    // The reader goes through the files in the order the workers take them, so the file is read or next in line
+    std::unique_lock<std::mutex> lock(mutex);
+    while (ready[file] == NULL)
+        changed.wait(lock);
+    PrefetchBuffer * buffer = ready[file];
+    ready[file] = NULL;
+    return buffer;
+}
+
+void Prefetcher::give(PrefetchBuffer * buffer)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ahead--;
+    aheadBytes -= buffer->size;
+    pool.push_back(buffer);
+    changed.notify_all();
+}
+
+bool hasCr2Extension(const char * fname)
+{
+    size_t len = strlen(fname);
+    return len > 4 && strcasecmp(fname + len - 4, ".cr2") == 0;
+}
+
+bool listBatchFiles(const char * source, std::vector<std::string> & files)
+{
+    // Either a directory of CR2 files or a text file with one path per line
+    struct stat st;
+    if (stat(source, &st) != 0)
+        return false;
+
+    if (S_ISDIR(st.st_mode))
+    {
+        DIR * dir = opendir(source);
+        if (dir == NULL)
+            return false;
+        struct dirent * entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (hasCr2Extension(entry->d_name))
+                files.push_back(std::string(source) + "/" + entry->d_name);
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+        return true;
+    }
+
+    FILE * list = fopen(source, "r");
+    if (list == NULL)
+        return false;
+    char line[4096];
+    while (fgets(line, sizeof(line), list))
+    {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = 0;
+        if (len)
+            files.push_back(line);
+    }
+    fclose(list);
+    return true;
+}
+
+bool decodeBatchFile(BatchJob & job, Cr2Decoder & decoder, std::vector<uint16_t> & photosites, FrameStats & frameStats, long file, std::string out_fname, 
+                     long * numPhotosites, double * inputWait)
+{
+    const char * in_fname = job.files[file].c_str();
+    if (job.opts.preview)
+    {
+        // Only a few header reads and the preview bytes, nothing to hold against the budget
+        InputFile input;
+        if (!input.open(in_fname, true))
+            return false;
+        int numWritten = extractPreviews(&input, out_fname.c_str(), false);
+        input.close();
+        *numPhotosites = 0;
+        return numWritten > 0;
+    }
+
+    // The decoder and the photosites belong to the worker, their buffers are reused for its next file. The file was read
+    // ahead by the prefetcher, or is read here, either way the worker is idle on input until it has the bytes.
+    double waitStart = monotonicSeconds();
+    PrefetchBuffer * buffer = job.prefetch ? job.prefetch->take(file) : NULL;
+    bool opened = buffer ? buffer->ok && decoder.open(buffer->data, buffer->size) : decoder.open(in_fname);
+    *inputWait += monotonicSeconds() - waitStart;
+    if (!opened)
+    {
+        if (buffer)
+            job.prefetch->give(buffer);
+        return false;
+    }
+    ImData & im = decoder.im;
+
+    // Photosites (or RGB and the YCbCr planes of sRAW/mRAW), the scan values before un-slicing, the file bytes, the
+    // unstuffed scan and the write buffers
+    bool sraw = isSraw(im);
+    int channels = sraw ? 3 : 1;
+    long frame = long(decoder.width())*decoder.height();
+    long bytes = (channels + 1)*frame*sizeof(uint16_t) + decoder.input.size + im.raw_scan_size + 2*WRITER_BUFFER_SIZE;
+    job.budget.acquire(bytes);
+
+    ImageWriter writer;
+    int format = job.opts.format >= 0 ? job.opts.format : FORMAT_DAT;
+    out_fname += imageExtension(format, channels);
+    if (!writer.open(out_fname.c_str(), format, decoder.width(), decoder.height(), channels, sraw ? 65535 : (1 << im.precision) - 1))
+    {
+        if (buffer)
+            job.prefetch->give(buffer);
+        job.budget.release(bytes);
+        return false;
+    }
+
+    // The statistics are of the Bayer photosites, sRAW and mRAW files have none
+    if (job.statsOut && !sraw)
+    {
+        frameStats.begin(im, job.opts);
+        writer.frameStats = &frameStats;
+    }
+
+    // The batch already runs a worker per core, so the sRAW conversion stays on this one
+    if (long(photosites.size()) < channels*frame)
+        photosites.resize(channels*frame);
+    long badCodes = sraw ? decoder.decodeSraw(&photosites[0], &writer, 1) : decoder.decode(&photosites[0], &writer);
+    if (buffer)
+        job.prefetch->give(buffer);
+
+    bool ok = writer.close();
+    job.budget.release(bytes);
+
+    if (writer.frameStats)
+    {
+        std::string record = frameStats.record(in_fname);
+        std::lock_guard<std::mutex> lock(job.statsMutex);
+        fwrite(record.data(), 1, record.size(), job.statsOut);
+    }
+
+    if (badCodes)
+        printf("Warning: %s has %ld undecodable codes\n", in_fname, badCodes);
+
+    *numPhotosites = frame;
+    return ok;
+}
+
+void batchWorker(BatchJob * job, int worker)
+{
+    Cr2Decoder decoder;
+    decoder.opts = job->opts;
+    std::vector<uint16_t> photosites;
+    FrameStats frameStats;
+
+    while (true)
+    {
+        long i = job->next++;
+        if (i >= long(job->files.size()))
+            break;
+
+        const std::string & in_fname = job->files[i];
+        size_t slash = in_fname.find_last_of('/');
+        std::string base = slash == std::string::npos ? in_fname : in_fname.substr(slash + 1);
+        size_t dot = base.find_last_of('.');
+        if (dot != std::string::npos && dot > 0)
+            base.erase(dot);
+        std::string out_fname = job->outDir + "/" + base; // The extension follows the channels of the file
+
+        // Each file is parsed and decoded on its own, a bad file only fails itself
+        long numPhotosites = 0;
+        if (decodeBatchFile(*job, decoder, photosites, frameStats, i, out_fname, &numPhotosites, &job->inputWait[worker]))
+        {
+            job->done++;
+            job->photosites += numPhotosites;
+        }
+        else
+        {
+            job->failed++;
+            printf("FAILED %s\n", in_fname.c_str());
+        }
+    }
+}
+
+int runBatch(const char * source, const char * outDir, DecodeOptions opts)
+{
+    BatchJob job;
+    job.opts   = opts;
+    job.outDir = outDir;
+    job.budget.limit = opts.maxInflightMB << 20;
+
+    if (!listBatchFiles(source, job.files))
+    {
+        printf("The batch source \"%s\" cannot be read!\n", source);
+        return 1;
+    }
+
+    // The output directory is made once here, rather than every file failing on its own
+    struct stat st;
+    if (stat(outDir, &st) != 0 && mkdir(outDir, 0755) != 0)
+    {
+        printf("The output directory \"%s\" cannot be created!\n", outDir);
+        return 1;
+    }
+    if (stat(outDir, &st) != 0 || !S_ISDIR(st.st_mode) || access(outDir, W_OK) != 0)
+    {
+        printf("The output \"%s\" is not a directory that can be written!\n", outDir);
+        return 1;
+    }
+
+    if (opts.frameStatsFile && !opts.preview)
+    {
+        job.statsOut = fopen(opts.frameStatsFile, "wb");
+        if (job.statsOut == NULL)
+        {
+            printf("The frame statistics file \"%s\" cannot be written!\n", opts.frameStatsFile);
+            return 1;
+        }
+    }
+
+    int numThreads = opts.threads > 0 ? opts.threads : std::thread::hardware_concurrency();
+    if (numThreads < 1)
+        numThreads = 1;
+    printf("Decoding %d files on %d threads\n", int(job.files.size()), numThreads);
+
+    double start = monotonicSeconds();
+    Prefetcher prefetch;
+    if (opts.readAhead > 0 && !opts.preview)
+    {
+        prefetch.start(job.files, opts.readAhead, opts.readAheadMB << 20);
+        job.prefetch = &prefetch;
+    }
+    job.inputWait.assign(numThreads, 0.0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < numThreads; t++)
+        workers.push_back(std::thread(batchWorker, &job, t));
+    for (int t = 0; t < numThreads; t++)
+        workers[t].join();
+    double wall = monotonicSeconds() - start;
+    if (job.statsOut)
+        fclose(job.statsOut);
+    if (stats.level)
+        stats.write(opts.statsFile, source);
+
+    printf("Decoded %ld files, %ld failed, in %.3f s: %.2f files/s, %.1f megapixels/s\n", 
+           long(job.done), long(job.failed), wall, job.done/wall, job.photosites/wall/1e6);
+
+    // The share of the worker time lost to input, what the read-ahead hides of the reading shows up as the difference
+    double waited = 0;
+    for (int t = 0; t < numThreads; t++)
+        waited += job.inputWait[t];
+    if (!opts.preview)
+    {
+        if (job.prefetch)
+            printf("Workers waited on input %.1f%% of the time, the reader read for %.3f s and held up to %d files and %.1f MB ahead (limit %d files, %ld MB)\n", 
+                   100*waited/(numThreads*wall), prefetch.readTime, prefetch.peakAhead, prefetch.peakAheadBytes/1048576.0, opts.readAhead, opts.readAheadMB);
+        else
+            printf("Workers read their input %.1f%% of the time\n", 100*waited/(numThreads*wall));
+    }
+    return job.failed ? 1 : 0;
+}
+
+// ==================================================================================================================================================================================================
+// Header only metadata index
+// ==================================================================================================================================================================================================
+
+void appendField(std::string & record, const char * name, const char * value, bool quote, bool json)
+{
+    // CSV fields are in a fixed order without names, strings are quoted and escaped in both formats
+    if (json)
+        record += record.empty() ? "{\"" : ",\"", record += name, record += "\":";
+    else if (!record.empty())
+        record += ",";
+
+    if (!quote)
+    {
+        record += value;
+        return;
+    }
+    record += "\"";
+    for (const char * c = value; *c; c++)
+    {
+        if (*c == '"')
+            record += json ? "\\\"" : "\"\"";
+        else if (json && *c == '\\')
+            record += "\\\\";
+        else if ((unsigned char)(*c) >= 0x20)
+            record += *c;
+    }
+    record += "\"";
+}
+
+void appendField(std::string & record, const char * name, long value, bool json)
+{
+    char text [32];
+    snprintf(text, sizeof(text), "%ld", value);
+    appendField(record, name, text, false, json);
+}
+
+std::string indexRecord(const char * fname, ImData * im, bool ok, long fileSize, bool json)
+{
+    std::string record;
+    char text [64];
+    appendField(record, "file", fname, true, json);
+    appendField(record, "ok", ok ? 1 : 0, json);
+    appendField(record, "file_size", fileSize, json);
+    appendField(record, "make", im->make, true, json);
+    appendField(record, "model", im->model, true, json);
+    snprintf(text, sizeof(text), "%u/%u", im->exposure_time[0], im->exposure_time[1]);
+    appendField(record, "exposure_time", text, true, json);
+    snprintf(text, sizeof(text), "%.1f", im->f_number[1] ? double(im->f_number[0])/im->f_number[1] : 0.0);
+    appendField(record, "f_number", text, false, json);
+    appendField(record, "sensor_width", im->sensor_width, json);
+    appendField(record, "sensor_height", im->sensor_height, json);
+    appendField(record, "left_border", im->sensor_left_border, json);
+    appendField(record, "top_border", im->sensor_top_border, json);
+    appendField(record, "right_border", im->sensor_right_border, json);
+    appendField(record, "bottom_border", im->sensor_bottom_border, json);
+    appendField(record, "slice_count", im->cr2_slice[0], json);
+    appendField(record, "slice_width", im->cr2_slice[1], json);
+    appendField(record, "slice_last_width", im->cr2_slice[2], json);
+    appendField(record, "precision", im->precision, json);
+    appendField(record, "components", im->num_comp, json);
+    appendField(record, "raw_offset", im->raw_offset, json);
+    appendField(record, "raw_size", im->raw_size, json);
+    record += json ? "}\n" : "\n";
+    return record;
+}
+
+void indexWorker(IndexJob * job)
+{
+    std::string records;
+    while (true)
+    {
+        long i = job->next++;
+        if (i >= long(job->files.size()))
+            break;
+
+        // parseHeaders stops after the lossless JPEG headers in front of the scan, only a few KB of each file are read
+        const char * fname = job->files[i].c_str();
+        InputFile input;
+        ImData im = ImData();
+        bool ok = input.open(fname, job->opts.mmap);
+        long fileSize = input.size;
+        if (ok)
+        {
+            im.input = &input;
+            ok = parseHeaders(&im, false);
+            input.close();
+        }
+        if (!ok)
+            im = ImData();
+        (ok ? job->done : job->failed)++;
+
+        // Written in blocks of records to keep the lock out of the way
+        records += indexRecord(fname, &im, ok, fileSize, job->json);
+        if (records.size() > 1 << 16)
+        {
+            std::lock_guard<std::mutex> lock(job->outMutex);
+            fwrite(records.data(), 1, records.size(), job->out);
+            records.clear();
+        }
+    }
+    std::lock_guard<std::mutex> lock(job->outMutex);
+    fwrite(records.data(), 1, records.size(), job->out);
+}
+
+int runIndex(const char * source, const char * out_fname, DecodeOptions opts)
+{
+    IndexJob job;
+    job.opts = opts;
+
+    if (hasCr2Extension(source))
+        job.files.push_back(source);
+    else if (!listBatchFiles(source, job.files))
+    {
+        printf("The index source \"%s\" cannot be read!\n", source);
+        return 1;
+    }
+
+    size_t len = strlen(out_fname);
+    job.json = (len > 5 && strcmp(out_fname + len - 5, ".json") == 0) || (len > 6 && strcmp(out_fname + len - 6, ".jsonl") == 0);
+    job.out  = fopen(out_fname, "wb");
+    if (job.out == NULL)
+    {
+        printf("The index file \"%s\" cannot be written!\n", out_fname);
+        return 1;
+    }
+    if (!job.json)
+        fputs("file,ok,file_size,make,model,exposure_time,f_number,sensor_width,sensor_height,left_border,top_border,right_border,bottom_border,"
+              "slice_count,slice_width,slice_last_width,precision,components,raw_offset,raw_size\n", job.out);
+
+    int numThreads = opts.threads > 0 ? opts.threads : std::thread::hardware_concurrency();
+    if (numThreads < 1)
+        numThreads = 1;
+
+    double start = monotonicSeconds();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < numThreads; t++)
+        workers.push_back(std::thread(indexWorker, &job));
+    for (int t = 0; t < numThreads; t++)
+        workers[t].join();
+    double wall = monotonicSeconds() - start;
+    fclose(job.out);
+
+    printf("Indexed %ld files, %ld failed, in %.3f s: %.0f files/s\n", long(job.done), long(job.failed), wall, (job.done + job.failed)/wall);
+    return job.failed ? 1 : 0;
+}
+
+// ==================================================================================================================================================================================================
+// Frame statistics
+// ==================================================================================================================================================================================================
+
+void FrameStats::begin(const ImData & im, const DecodeOptions & opts)
+{
+    width      = im.sensor_width;
+    height     = im.sensor_height;
+    precision  = im.precision < 1 ? 1 : im.precision > 16 ? 16 : im.precision;
+    whiteLevel = (1 << precision) - 1;
+    bayerX     = opts.bayerX;
+    bayerY     = opts.bayerY;
+
+    // SENSOR_INFO gives the last column and row of the active area, files without it are all active
+    bool active = im.sensor_right_border > im.sensor_left_border && im.sensor_right_border < width && 
+                  im.sensor_bottom_border > im.sensor_top_border && im.sensor_bottom_border < height;
+    left   = active ? im.sensor_left_border : 0;
+    top    = active ? im.sensor_top_border : 0;
+    right  = active ? im.sensor_right_border : width - 1;
+    bottom = active ? im.sensor_bottom_border : height - 1;
+
+    bins = 1 << (precision > FRAME_STATS_BITS ? precision : FRAME_STATS_BITS);
+    hist.assign(2*2*4*long(bins), 0);
+}
+
+void FrameStats::addRows(const uint16_t * rows, int y0, int numRows)
+{
+    for (int r = 0; r < numRows; r++)
+    {
+        int y = y0 + r;
+        const uint16_t * row = rows + long(r)*width;
+        bool activeRow = y >= top && y <= bottom;
+        int x0 = activeRow ? left : width;
+        int x1 = activeRow ? right + 1 : width;
+        addRun(row, 0, x0, 1, y & 1);
+        addRun(row, x0, x1, 0, y & 1);
+        addRun(row, x1, width, 1, y & 1);
+    }
+}
+
+inline int statsBin(int value, int maxBin)
+{
+    return value < maxBin ? value : maxBin;
+}
+
+void FrameStats::addRun(const uint16_t * row, int x, int end, int region, int rowParity)
+{
+    // Photosites x and x + 1 go to the first copy of their channel and x + 2 and x + 3 to the second. A value above
+    // the precision, from a damaged scan, is counted in the top bin.
+    const int maxBin = bins - 1;
+    uint32_t * h  = &hist[long(region*2*4 + rowParity*2)*bins];
+    uint32_t * a0 = h + (x & 1)*bins;
+    uint32_t * a1 = h + ((x & 1) ^ 1)*bins;
+    uint32_t * b0 = a0 + 4*bins;
+    uint32_t * b1 = a1 + 4*bins;
+
+    for (; x + 4 <= end; x += 4)
+    {
+        a0[statsBin(row[x], maxBin)]++;
+        a1[statsBin(row[x + 1], maxBin)]++;
+        b0[statsBin(row[x + 2], maxBin)]++;
+        b1[statsBin(row[x + 3], maxBin)]++;
+    }
+    for (int i = 0; x < end; x++, i ^= 1)
+        (i ? a1 : a0)[statsBin(row[x], maxBin)]++;
+}
+
+std::string FrameStats::record(const char * fname) const
+{
+    static const char * regionNames [2] = { "active", "border" };
+    const int shift = precision > FRAME_STATS_BITS ? precision - FRAME_STATS_BITS : 0;
+    char text [64];
+
+    std::string record;
+    appendField(record, "file", fname, true, true);
+    appendField(record, "width", width, true);
+    appendField(record, "height", height, true);
+    appendField(record, "precision", precision, true);
+    appendField(record, "white_level", whiteLevel, true);
+    appendField(record, "left_border", left, true);
+    appendField(record, "top_border", top, true);
+    appendField(record, "right_border", right, true);
+    appendField(record, "bottom_border", bottom, true);
+
+    std::vector<uint64_t> merged(1 << FRAME_STATS_BITS);
+    for (int region = 0; region < 2; region++)
+    {
+        record += ",\"", record += regionNames[region], record += "\":[";
+        for (int c = 0; c < 4; c++)
+        {
+            // Channel c is at (c & 1, c >> 1) in the 2x2 block, green next to red horizontally is Gr
+            int px = c & 1, py = c >> 1;
+            const char * name = px == bayerX && py == bayerY ? "R" : px != bayerX && py != bayerY ? "B" : py == bayerY ? "Gr" : "Gb";
+            const uint32_t * h0 = &hist[long(region*2*4 + c)*bins];
+            const uint32_t * h1 = h0 + 4*bins;
+
+            uint64_t count = 0, sum = 0, sumSq = 0, clipped = 0;
+            int minValue = -1, maxValue = 0;
+            std::fill(merged.begin(), merged.end(), 0);
+            for (int v = 0; v < bins; v++)
+            {
+                uint64_t n = uint64_t(h0[v]) + h1[v];
+                if (n == 0)
+                    continue;
+                minValue = minValue < 0 ? v : minValue;
+                maxValue = v;
+                count   += n;
+                sum     += n*v;
+                sumSq   += n*v*uint64_t(v);
+                clipped += v >= whiteLevel ? n : 0;
+                merged[v >> shift] += n;
+            }
+            double mean = count ? double(sum)/count : 0.0;
+            double variance = count ? double(sumSq)/count - mean*mean : 0.0;
+
+            std::string channel;
+            appendField(channel, "channel", name, true, true);
+            appendField(channel, "count", long(count), true);
+            appendField(channel, "min", minValue < 0 ? 0 : minValue, true);
+            appendField(channel, "max", maxValue, true);
+            snprintf(text, sizeof(text), "%.3f", mean);
+            appendField(channel, "mean", text, false, true);
+            snprintf(text, sizeof(text), "%.3f", variance > 0 ? variance : 0.0);
+            appendField(channel, "variance", text, false, true);
+            appendField(channel, "clipped", long(clipped), true);
+
+            // The 14 bit histogram up to its last count
+            int last = (1 << FRAME_STATS_BITS) - 1;
+            while (last >= 0 && merged[last] == 0)
+                last--;
+            channel += ",\"histogram\":[";
+            for (int v = 0; v <= last; v++)
+            {
+                snprintf(text, sizeof(text), v ? ",%lu" : "%lu", (unsigned long)(merged[v]));
+                channel += text;
+            }
+            channel += "]}";
+
+            record += c ? "," : "", record += channel;
+        }
+        record += "]";
+    }
+    record += "}\n";
+    return record;
+}
+
+bool writeFrameStats(const char * fname, const std::string & record)
+{
+    FILE * filep = fopen(fname, "wb");
+    if (filep == NULL)
+    {
+        printf("The frame statistics file \"%s\" cannot be written!\n", fname);
+        return false;
+    }
+    bool ok = fwrite(record.data(), 1, record.size(), filep) == record.size();
+    return fclose(filep) == 0 && ok;
+}
+
+// ==================================================================================================================================================================================================
+// Demosaicing
+// ==================================================================================================================================================================================================
+
+inline int mirrorIndex(int i, int n)
+{
+    // Reflects about the edge photosite, which keeps the position in the Bayer pattern
+    i = i < 0 ? -i : i;
+    return i < n ? i : 2*n - 2 - i;
+}
+
+inline int hueTransit(int l1, int l2, int l3, int v1, int v3)
+{
+    // Color difference interpolation of v at the middle of three luma samples l
+    if ((l1 < l2 && l2 < l3) || (l1 > l2 && l2 > l3))
+        return v1 + (v3 - v1)*(l2 - l1)/(l3 - l1);
+    return (v1 + v3)/2 + (2*l2 - l1 - l3)/4;
+}
+
+void demosaicTile(DemosaicJob * job, int y0, int y1, std::vector<int> & raw, std::vector<int> & green)
+{
+    // The tile and its halo are copied to a padded buffer first, so the filters below never check the frame edges
+    const int H = DEMOSAIC_HALO;
+    int W = job->width;
+    int pw = W + 2*H;
+    int numRows = y1 - y0 + 2*H;
+    raw.resize(long(pw)*numRows);
+    green.resize(long(pw)*numRows);
+
+    for (int r = 0; r < numRows; r++)
+    {
+        const uint16_t * src = job->mosaic + long(mirrorIndex(y0 - H + r, job->height))*W;
+        int * dst = &raw[long(r)*pw];
+        for (int c = 0; c < H; c++)
+        {
+            dst[c] = src[mirrorIndex(c - H, W)];
+            dst[W + H + c] = src[mirrorIndex(W + c, W)];
+        }
+        for (int x = 0; x < W; x++)
+            dst[x + H] = src[x];
+    }
+
+    // Offsets in the padded buffer
+    const int N = -pw, S = pw, E = 1, Wd = -1;
+    int maxValue = job->maxValue;
+    long frame = long(W)*job->height;
+
+    if (job->method == DEMOSAIC_PPG)
+    {
+        // Green at the red and blue photosites along the direction with the smallest gradient, one row and column of halo
+        for (int r = H - 1; r < numRows - H + 1; r++)
+        {
+            int y = y0 - H + r;
+            for (int x = -1; x < W + 1; x++)
+            {
+                long i = long(r)*pw + x + H;
+                const int * p = &raw[i];
+                bool isGreen = ((x + job->bayerX) ^ (y + job->bayerY)) & 1;
+                if (isGreen)
+                {
+                    green[i] = p[0];
+                    continue;
+                }
+                int dN = 2*abs(p[0] - p[2*N]) + abs(p[N] - p[S]);
+                int dS = 2*abs(p[0] - p[2*S]) + abs(p[S] - p[N]);
+                int dW = 2*abs(p[0] - p[2*Wd]) + abs(p[Wd] - p[E]);
+                int dE = 2*abs(p[0] - p[2*E]) + abs(p[E] - p[Wd]);
+                int g;
+                int dMin = dN < dS ? dN : dS;
+                dMin = dW < dMin ? dW : dMin;
+                dMin = dE < dMin ? dE : dMin;
+                if (dMin == dN)
+                    g = (3*p[N] + p[S] + p[0] - p[2*N])/4;
+                else if (dMin == dE)
+                    g = (3*p[E] + p[Wd] + p[0] - p[2*E])/4;
+                else if (dMin == dW)
+                    g = (3*p[Wd] + p[E] + p[0] - p[2*Wd])/4;
+                else
+                    g = (3*p[S] + p[N] + p[0] - p[2*S])/4;
+                green[i] = g < 0 ? 0 : (g > maxValue ? maxValue : g);
+            }
+        }
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        int r = y - y0 + H;
+        for (int x = 0; x < W; x++)
+        {
+            long i = long(r)*pw + x + H;
+            const int * p = &raw[i];
+            const int * g = &green[i];
+            int color = ((y + job->bayerY) & 1)*2 + ((x + job->bayerX) & 1); // 0 R, 1 G on a red row, 2 G on a blue row, 3 B
+            int R, G, B;
+
+            if (job->method == DEMOSAIC_PPG)
+            {
+                if (color == 1 || color == 2)
+                {
+                    // Red and blue at green photosites, from the neighbours across the row and across the column
+                    int horizontal = hueTransit(g[Wd], p[0], g[E], p[Wd], p[E]);
+                    int vertical   = hueTransit(g[N],  p[0], g[S], p[N],  p[S]);
+                    G = p[0];
+                    R = color == 1 ? horizontal : vertical;
+                    B = color == 1 ? vertical   : horizontal;
+                }
+                else
+                {
+                    // The other chroma from the diagonal with the smallest gradient
+                    int dNE = abs(p[N + E] - p[S + Wd]) + abs(p[2*(N + E)] - p[0]) + abs(p[0] - p[2*(S + Wd)]) + abs(g[N + E] - g[0]) + abs(g[0] - g[S + Wd]);
+                    int dNW = abs(p[N + Wd] - p[S + E]) + abs(p[2*(N + Wd)] - p[0]) + abs(p[0] - p[2*(S + E)]) + abs(g[N + Wd] - g[0]) + abs(g[0] - g[S + E]);
+                    int other = dNE < dNW ? hueTransit(g[N + E], g[0], g[S + Wd], p[N + E], p[S + Wd])
+                                          : hueTransit(g[N + Wd], g[0], g[S + E], p[N + Wd], p[S + E]);
+                    G = g[0];
+                    R = color == 0 ? p[0] : other;
+                    B = color == 0 ? other : p[0];
+                }
+            }
+            else
+            {
+                int cross    = (p[N] + p[S] + p[E] + p[Wd] + 2)/4;
+                int diagonal = (p[N + E] + p[N + Wd] + p[S + E] + p[S + Wd] + 2)/4;
+                int across   = (p[E] + p[Wd] + 1)/2;
+                int along    = (p[N] + p[S] + 1)/2;
+                if (color == 0)
+                    R = p[0], G = cross, B = diagonal;
+                else if (color == 3)
+                    R = diagonal, G = cross, B = p[0];
+                else if (color == 1)
+                    R = across, G = p[0], B = along;
+                else
+                    R = along, G = p[0], B = across;
+            }
+
+            R = R < 0 ? 0 : (R > maxValue ? maxValue : R);
+            B = B < 0 ? 0 : (B > maxValue ? maxValue : B);
+            long o = long(y)*W + x;
+            if (job->planar)
+            {
+                job->rgb[o] = R;
+                job->rgb[frame + o] = G;
+                job->rgb[2*frame + o] = B;
+            }
+            else
+            {
+                job->rgb[3*o + 0] = R;
+                job->rgb[3*o + 1] = G;
+                job->rgb[3*o + 2] = B;
+            }
+        }
+    }
+}
+
+void demosaicWorker(DemosaicJob * job)
+{
+    // The padded buffers are kept from tile to tile
+    std::vector<int> raw, green;
+    while (true)
+    {
+        int y0 = DEMOSAIC_TILE_ROWS*job->nextTile++;
+        if (y0 >= job->height)
+            break;
+        int y1 = y0 + DEMOSAIC_TILE_ROWS < job->height ? y0 + DEMOSAIC_TILE_ROWS : job->height;
+        demosaicTile(job, y0, y1, raw, green);
+    }
+}
+
+double demosaic(uint16_t * rgb, const uint16_t * mosaic, int width, int height, int maxValue, DecodeOptions opts)
+{
+    // Returns the wall time in seconds
+    DemosaicJob job;
+    job.mosaic   = mosaic;
+    job.rgb      = rgb;
+    job.width    = width;
+    job.height   = height;
+    job.method   = opts.demosaic == DEMOSAIC_PPG ? DEMOSAIC_PPG : DEMOSAIC_BILINEAR;
+    job.planar   = opts.planar;
+    job.bayerX   = opts.bayerX;
+    job.bayerY   = opts.bayerY;
+    job.maxValue = maxValue;
+
+    int numThreads = opts.threads > 0 ? opts.threads : std::thread::hardware_concurrency();
+    int numTiles   = (height + DEMOSAIC_TILE_ROWS - 1)/DEMOSAIC_TILE_ROWS;
+    numThreads = numThreads < numTiles ? numThreads : numTiles;
+    numThreads = numThreads > 1 ? numThreads : 1;
+
+    double start = monotonicSeconds();
+    std::vector<std::thread> workers;
+    for (int t = 1; t < numThreads; t++)
+        workers.push_back(std::thread(demosaicWorker, &job));
+    demosaicWorker(&job);
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+    return monotonicSeconds() - start;
+}
+
+// ==================================================================================================================================================================================================
+// sRAW and mRAW
+// ==================================================================================================================================================================================================
+
+bool isSraw(const ImData & im)
+{
+    return im.sraw_width > 0;
+}
+
+void ScanDecoder::decodeSraw(ImData & im, uint16_t * luma, uint16_t * cb, uint16_t * cr)
+{
+    // The walk of decodeFrame in MCUs: a slice holds its CR2_SLICE samples / (lumaH*lumaV + 2) MCUs side by side, every MCU
+    // covers lumaH x lumaV pixels of the luma plane and one sample of each of the chroma planes
+    int mcuSamples  = im.lumaH*im.lumaV + 2;
+    int chromaWidth = im.sraw_width/im.lumaH;
+    int mcuRows     = im.sraw_height/im.lumaV;
+    int lineMcus    = im.samples_per_line;
+    int slice = 0, sliceX0 = 0, sliceRow = 0, col = 0;
+    int sliceMcus = (im.cr2_slice[0] ? im.cr2_slice[1] : im.cr2_slice[2])/mcuSamples;
+
+    for (int r = 0; r < im.num_lines; r++)
+    {
+        uint16_t pred [3] = { lineStart[0], lineStart[1], lineStart[2] };
+        for (int x = 0; x < lineMcus; )
         {
-            // cropSliceOne[ctr++] = sliceOne[j + i*sliceOneWidth];
-            cropSliceOne[ctr++] = sliceTwo[j + i*sliceTwoWidth];
+            int n = lineMcus - x < sliceMcus - col ? lineMcus - x : sliceMcus - col;
+            long chroma = long(sliceRow)*chromaWidth + sliceX0 + col;
+            uint16_t * y = luma + long(sliceRow)*im.lumaV*im.sraw_width + long(sliceX0 + col)*im.lumaH;
+            (this->*mcuKernel)(y, im.sraw_width, cb + chroma, cr + chroma, n, pred);
+
+            if (x == 0)
+            {
+                lineStart[0] = y[0];
+                lineStart[1] = cb[chroma];
+                lineStart[2] = cr[chroma];
+            }
+
+            x   += n;
+            col += n;
+            if (col == sliceMcus)
+            {
+                col = 0;
+                if (++sliceRow == mcuRows)
+                {
+                    sliceRow = 0;
+                    sliceX0 += sliceMcus;
+                    slice++;
+                    sliceMcus = (slice < im.cr2_slice[0] ? im.cr2_slice[1] : im.cr2_slice[2])/mcuSamples;
+                }
+            }
         }
-    }    
+    }
+    samplesDone += long(im.num_lines)*lineWidth;
+}
 
-    printf("trying to get bayer data\n");
-    // TRYING TO GET BAYER DATA
+void srawChromaRow(int16_t * out, const uint16_t * chroma, int chromaWidth, int y, int height, int lumaV)
+{
+    // The chroma samples sit on the even columns, and for 4:2:0 on the even rows, the others are the mean of their two
+    // neighbours and the last row and column copy theirs, as dcraw does. The samples are centred on zero.
+    const uint16_t * above = chroma + long(y/lumaV)*chromaWidth;
+    const uint16_t * below = lumaV == 2 && (y & 1) && y + 1 < height ? above + chromaWidth : above;
+    for (int k = 0; k < chromaWidth; k++)
+        out[2*k] = int16_t(((above[k] + below[k] + 1) >> 1) - 16384);
+    for (int k = 0; k < chromaWidth - 1; k++)
+        out[2*k + 1] = int16_t((out[2*k] + out[2*k + 2] + 1) >> 1);
+    out[2*chromaWidth - 1] = out[2*chromaWidth - 2];
+}
 
-    // dSliceOne
-    int dSliceOneLen = cr2slice[1]*imageData.sensor_height;
-    int dSliceOneWidth = cr2slice[1];
-    int dSliceOneHeight = imageData.sensor_height;
-    int * dSliceOne = new int [dSliceOneLen];
-    ctr = 0;
-    for (int i = 0 + (sliceOneWidth*sliceOneHeight); i < (sliceTwoLen + (sliceOneWidth*sliceOneHeight)) /*sliceOneLen*/ ; i++)
+void srawRgbRow(uint16_t * rgb, const uint16_t * luma, const int16_t * cb, const int16_t * cr, int width)
+{
+    // R = Y + Cr, B = Y + Cb and G = Y + (-778 Cb - 2048 Cr)/4096, clipped to 16 bits
+    int x = 0;
+#ifdef __SSE2__
+    // The green term is one multiply-add of the interleaved (Cb, Cr) pairs. The sums are moved into the signed
+    // range so that the signed saturating pack clips them to 0..65535.
+    const __m128i coef = _mm_set_epi16(-2048, -778, -2048, -778, -2048, -778, -2048, -778);
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16(-32768);
+    const __m128i zero = _mm_setzero_si128();
+    alignas(16) uint16_t r [8], g [8], b [8];
+    for (; x + 8 <= width; x += 8)
+    {
+        __m128i y  = _mm_loadu_si128((const __m128i *)(luma + x));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(cb + x));
+        __m128i vr = _mm_loadu_si128((const __m128i *)(cr + x));
+        __m128i yLo = _mm_unpacklo_epi16(y, zero);
+        __m128i yHi = _mm_unpackhi_epi16(y, zero);
+
+        __m128i rLo = _mm_add_epi32(yLo, _mm_srai_epi32(_mm_unpacklo_epi16(vr, vr), 16));
+        __m128i rHi = _mm_add_epi32(yHi, _mm_srai_epi32(_mm_unpackhi_epi16(vr, vr), 16));
+        __m128i bLo = _mm_add_epi32(yLo, _mm_srai_epi32(_mm_unpacklo_epi16(vb, vb), 16));
+        __m128i bHi = _mm_add_epi32(yHi, _mm_srai_epi32(_mm_unpackhi_epi16(vb, vb), 16));
+        __m128i gLo = _mm_add_epi32(yLo, _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(vb, vr), coef), 12));
+        __m128i gHi = _mm_add_epi32(yHi, _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(vb, vr), coef), 12));
+
+        _mm_store_si128((__m128i *)r, _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(rLo, bias), _mm_sub_epi32(rHi, bias)), flip));
+        _mm_store_si128((__m128i *)g, _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(gLo, bias), _mm_sub_epi32(gHi, bias)), flip));
+        _mm_store_si128((__m128i *)b, _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(bLo, bias), _mm_sub_epi32(bHi, bias)), flip));
+        for (int i = 0; i < 8; i++)
+        {
+            rgb[3*(x + i)]     = r[i];
+            rgb[3*(x + i) + 1] = g[i];
+            rgb[3*(x + i) + 2] = b[i];
+        }
+    }
+#endif
+    for (; x < width; x++)
     {
-        dSliceOne[ctr++] = diffValueList[i];
+        int Y = luma[x], Cb = cb[x], Cr = cr[x];
+        int c [3] = { Y + Cr, Y + ((-778*Cb - 2048*Cr) >> 12), Y + Cb };
+        for (int i = 0; i < 3; i++)
+            rgb[3*x + i] = c[i] < 0 ? 0 : (c[i] > 65535 ? 65535 : c[i]);
     }
+}
 
-    printf("cropping\n");
-    // Cropped dSlice
-    int cdHeight = cropSliceH - cropTop;
-    int cdWidth  = cropSliceW;
-    int cdLen    = cdHeight*cdWidth;
-    int * cdSliceOne = new int [cdLen];
-    ctr = 0;
-    for (int i = cropTop; i < cropSliceH; i++)
+void srawWorker(SrawJob * job)
+{
+    // The chroma rows of the band are brought up to the luma resolution one at a time
+    std::vector<int16_t> cb(job->width), cr(job->width);
+    int chromaWidth = job->width/2;
+    while (true)
     {
-        for (int j = cropLeft; j < cropRight; j++ )
+        int y0 = SRAW_BAND_ROWS*job->nextBand++;
+        if (y0 >= job->height)
+            break;
+        int y1 = y0 + SRAW_BAND_ROWS < job->height ? y0 + SRAW_BAND_ROWS : job->height;
+        for (int y = y0; y < y1; y++)
         {
-            cdSliceOne[ctr++] = dSliceOne[j + i*dSliceOneWidth];
+            srawChromaRow(&cb[0], job->cb, chromaWidth, y, job->height, job->lumaV);
+            srawChromaRow(&cr[0], job->cr, chromaWidth, y, job->height, job->lumaV);
+            srawRgbRow(job->rgb + 3*long(y)*job->width, job->luma + long(y)*job->width, &cb[0], &cr[0], job->width);
         }
-    }    
+    }
+}
 
-    printf("accumulating\n"); 
-    // Accumulated slice
-    int * accumSliceOne = new int [cdLen];
-    int prevRG[2] = {0,0}; // RG previous
-    int prevGB[2] = {0,0}; // GB previous
-    ctr = 0;
+double srawToRgb(uint16_t * rgb, const uint16_t * luma, const uint16_t * cb, const uint16_t * cr, ImData & im, int numThreads)
+{
+    // Returns the wall time in seconds
+    SrawJob job;
+    job.luma   = luma;
+    job.cb     = cb;
+    job.cr     = cr;
+    job.rgb    = rgb;
+    job.width  = im.sraw_width;
+    job.height = im.sraw_height;
+    job.lumaV  = im.lumaV;
+
+    int numBands = (job.height + SRAW_BAND_ROWS - 1)/SRAW_BAND_ROWS;
+    numThreads = numThreads > 0 ? numThreads : std::thread::hardware_concurrency();
+    numThreads = numThreads < numBands ? numThreads : numBands;
+    numThreads = numThreads > 1 ? numThreads : 1;
+
+    double start = monotonicSeconds();
+    std::vector<std::thread> workers;
+    for (int t = 1; t < numThreads; t++)
+        workers.push_back(std::thread(srawWorker, &job));
+    srawWorker(&job);
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+    return monotonicSeconds() - start;
+}
+
+long Cr2Decoder::decodeSraw(uint16_t * rgb, ImageWriter * writer, int numThreads)
+{
+    // The scan is decoded into a luma plane and two chroma planes, which are then converted to RGB on numThreads
+    if (im.input == NULL || !isSraw(im))
+        return -1;
+    scan.begin(im, opts);
+
+    long lumaSize   = long(im.sraw_width)*im.sraw_height;
+    long chromaSize = lumaSize/(im.lumaH*im.lumaV);
+    if (planesCapacity < lumaSize + 2*chromaSize)
+    {
+        delete [] planes;
+        stats.release(planesCapacity*sizeof(uint16_t));
+        planesCapacity = lumaSize + 2*chromaSize;
+        planes = new uint16_t [planesCapacity];
+        stats.alloc(planesCapacity*sizeof(uint16_t));
+    }
+    uint16_t * luma = planes;
+    uint16_t * cb   = planes + lumaSize;
+    uint16_t * cr   = cb + chromaSize;
 
-    int lineBegRG[2] = {0,0};
-    int lineBegGB[2] = {0,0};
+    stats.start(STAGE_ENTROPY);
+    scan.decodeSraw(im, luma, cb, cr);
+    stats.stop(STAGE_ENTROPY);
 
-    for (int i = 0; i < cdHeight; i++)
+    stats.start(STAGE_CONVERT);
+    srawToRgb(rgb, luma, cb, cr, im, numThreads);
+    stats.stop(STAGE_CONVERT);
+
+    if (writer)
     {
-        // Reset prev channel values for each row. We set it to the beginning of the prev row.
-        prevRG[0] = lineBegRG[0];
-        prevRG[1] = lineBegRG[1];
-        prevGB[0] = lineBegGB[0];
-        prevGB[1] = lineBegGB[1];
+        stats.start(STAGE_OUTPUT);
+        writer->rowsReady(rgb, im.sraw_height);
+        stats.stop(STAGE_OUTPUT);
+    }
 
-        int prev = 20000;
+    stats.count(stats.symbols, long(im.num_lines)*scan.lineWidth);
+    stats.count(stats.badCodes, scan.badCodes);
+    stats.count(stats.slowPathHits, scan.huffTable.slowPathHits + scan.huffTable1.slowPathHits);
+    return scan.badCodes;
+}
+
+int runSraw(ImData & im, const char * out_fname, DecodeOptions opts)
+{
+    // sRAW and mRAW files are always written as 16 bit RGB, the difference values and photosites of a Bayer raw do not apply
+    Cr2Decoder decoder;
+    decoder.opts = opts;
+    decoder.im   = im;
+    int width = decoder.width(), height = decoder.height();
+
+    ImageWriter writer;
+    int format = opts.format >= 0 ? opts.format : imageFormat(out_fname);
+    if (!writer.open(out_fname, format, width, height, 3, 65535))
+        return 1;
+
+    long pixels = long(width)*height;
+    uint16_t * rgb = new uint16_t [3*pixels];
+    stats.alloc(3*pixels*sizeof(uint16_t));
+
+    double start = monotonicSeconds();
+    long badCodes = decoder.decodeSraw(rgb, &writer, opts.threads);
+    double decodeTime = monotonicSeconds() - start;
+    bool ok = writer.close();
+
+    printf("Decoded a %dx%d %s image (%dx%d luma per chroma sample) to RGB in %.3f ms (%.1f megapixels/s)\n", width, height, 
+           im.lumaV == 2 ? "4:2:0" : "4:2:2", im.lumaH, im.lumaV, 1e3*decodeTime, pixels/decodeTime/1e6);
+    if (badCodes)
+        printf("We didn't find code %ld times :O :O \n\n", badCodes);
+
+    delete [] rgb;
+    stats.release(3*pixels*sizeof(uint16_t));
+    return ok ? 0 : 1;
+}
+
+// ==================================================================================================================================================================================================
+// Synthetic CR2 files
+// ==================================================================================================================================================================================================
+
+void put16(std::vector<uint8_t> & out, uint16_t v) { out.push_back(v & 0xFF); out.push_back(v >> 8); }
+void put32(std::vector<uint8_t> & out, uint32_t v) { put16(out, v & 0xFFFF); put16(out, v >> 16); }
+void putBE16(std::vector<uint8_t> & out, uint16_t v) { out.push_back(v >> 8); out.push_back(v & 0xFF); }
+
+void putTag(std::vector<uint8_t> & out, uint16_t id, uint16_t type, uint32_t values, uint32_t value)
+{
+    put16(out, id);
+    put16(out, type);
+    put32(out, values);
+    put32(out, value);
+}
+
+void synthHuffman(const long * histogram, uint8_t * huffData, uint8_t * huffValues)
+{
+    // Huffman code lengths for the 15 difference lengths, each counted at least once so that all 15 values
+    // are in the table as Canon has them. A 16th dummy symbol takes the all ones code, which JPEG does not allow.
+    long weight [16];
+    int  parent [31], len [16];
+    bool used [31];
+    for (int i = 0; i < 16; i++)
+        weight[i] = i < 15 ? histogram[i] + 1 : 0;
 
-        for (int j = 0; j < cdWidth; j++)
+    long nodeWeight [31];
+    for (int i = 0; i < 31; i++)
+        nodeWeight[i] = i < 16 ? weight[i] : 0, used[i] = false, parent[i] = -1;
+    for (int n = 16; n < 31; n++)
+    {
+        int a = -1, b = -1;
+        for (int i = 0; i < n; i++)
+        {
+            if (used[i])
+                continue;
+            if (a < 0 || nodeWeight[i] < nodeWeight[a])
+                b = a, a = i;
+            else if (b < 0 || nodeWeight[i] < nodeWeight[b])
+                b = i;
+        }
+        used[a] = used[b] = true;
+        parent[a] = parent[b] = n;
+        nodeWeight[n] = nodeWeight[a] + nodeWeight[b];
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        len[i] = 0;
+        for (int p = parent[i]; p >= 0; p = parent[p])
+            len[i]++;
+    }
+
+    // Canonical order, by length and then by value with the dummy last among the longest codes
+    int order [16];
+    for (int i = 0; i < 16; i++)
+        order[i] = i;
+    for (int i = 1; i < 16; i++)
+    {
+        for (int j = i; j > 0 && (len[order[j]] < len[order[j - 1]] || (len[order[j]] == len[order[j - 1]] && order[j - 1] == 15)); j--)
+            std::swap(order[j], order[j - 1]);
+    }
+
+    memset(huffData, 0, 16);
+    int k = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        if (order[i] == 15)
+            continue;
+        huffData[len[order[i]] - 1]++;
+        huffValues[k++] = order[i];
+    }
+}
+
+bool writeSynthCr2(const char * fname, uint16_t * photosites, SynthParams & sp)
+{
+    // A CR2 file as parseHeaders() reads it: the TIFF and CR2 headers, IFD#0, the EXIF subdir with the Makernote
+    // and its SENSOR_INFO, the RAW IFD with CR2_SLICE, and a lossless JPEG scan with 4 components. With sp.lumaV
+    // it is an sRAW file, a 15 bit scan of MCUs of 2 x lumaV luma samples, Cb and Cr, and photosites gets the 16 bit
+    // RGB the decoder must give, 3 interleaved channels of sp.width x sp.height pixels.
+    bool sraw = sp.lumaV > 0;
+    int W = sp.width, H = sp.height;
+    int numComp    = sraw ? 3 : 4;
+    int mcuSamples = sraw ? 2*sp.lumaV + 2 : numComp;
+    int precision  = sraw ? 15 : sp.precision;
+    if (W <= 0 || H <= 0 || sp.precision < 2 || sp.precision > 14 || long(sp.slices[0])*sp.slices[1] + sp.slices[2] != W ||
+        (sraw ? sp.lumaV > 2 || H % sp.lumaV || (sp.slices[0] && sp.slices[1] % 2) || sp.slices[2] % 2 || sp.slices[2]/2*mcuSamples > 65535 : W % numComp))
+    {
+        printf("Error in writeSynthCr2(): bad size %dx%d, precision %d or slices [%d, %d, %d]\n", 
+               W, H, sp.precision, sp.slices[0], sp.slices[1], sp.slices[2]);
+        return false;
+    }
+
+    // The slices count pixel columns as for a Bayer raw, CR2_SLICE counts the samples of the scan
+    uint16_t slices [3] = { sp.slices[0], sp.slices[1], sp.slices[2] };
+    if (sraw)
+        slices[1] = slices[1]/2*mcuSamples, slices[2] = slices[2]/2*mcuSamples;
+
+    // Layout of a scan line: the component of each sample of an MCU, and how far back the sample of the same
+    // component that predicts it is, for a Bayer raw the one 4 samples back and for sRAW the luma sample before
+    int lineWidth = sraw ? W/2*mcuSamples : W;
+    int numLines  = sraw ? H/sp.lumaV : H;
+    long numSamples = long(lineWidth)*numLines;
+    int mcuComp [6], back [6];
+    for (int k = 0; k < mcuSamples; k++)
+    {
+        mcuComp[k] = sraw ? (k < 2*sp.lumaV ? 0 : k - 2*sp.lumaV + 1) : k;
+        back[k]    = sraw && k < 2*sp.lumaV ? (k ? 1 : 3) : mcuSamples;
+    }
+
+    // Photosites
+    uint32_t rng = sp.seed ? sp.seed : 1;
+    int maxValue = (1 << sp.precision) - 1;
+    int black    = 1 << (sp.precision - 3);
+    int ramp     = sp.ramp < maxValue - black ? sp.ramp : maxValue - black;
+    int channelOffset [4] = { ramp/6, 0, 0, ramp/12 };
+
+    std::vector<uint16_t> scanValues(numSamples);
+    if (sraw)
+    {
+        // The luma is the ramp of the photosites, at least 1 so that its first difference from 1 << 14 fits 14 bits,
+        // and the chroma a ramp centred on 16384 within maxValue/2 of it
+        int chromaWidth = W/2, chromaHeight = H/sp.lumaV;
+        std::vector<uint16_t> planes [3];
+        for (int c = 0; c < 3; c++)
         {
-            if ( false ) // Ignore first two values
+            int pw = c ? chromaWidth : W, ph = c ? chromaHeight : H;
+            int noise = sp.tables[c] ? 4*sp.noise : sp.noise;
+            planes[c].resize(long(pw)*ph);
+            for (int y = 0; y < ph; y++)
             {
-                accumSliceOne[ctr] = 0;
-                ctr++;
+                for (int x = 0; x < pw; x++)
+                {
+                    rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+                    int v = c ? 16384 - ramp/2 + (x*(c == 1 ? 5 : 3) + y*(c == 1 ? 11 : 17)) % (ramp > 0 ? ramp : 1)
+                              : black + (x*7 + y*13) % (ramp > 0 ? ramp : 1);
+                    if (noise > 0)
+                        v += int(rng % (2*noise + 1)) - noise;
+                    int lo = c ? 16384 - maxValue/2 : 1, hi = c ? 16384 + maxValue/2 : maxValue;
+                    planes[c][long(y)*pw + x] = v < lo ? lo : (v > hi ? hi : v);
+                }
             }
-            else
+        }
+
+        // Scan order, the slices one after the other and the MCUs of a slice row by row
+        long n = 0;
+        for (int s = 0, x0 = 0; s <= sp.slices[0]; s++)
+        {
+            int sliceWidth = s < sp.slices[0] ? sp.slices[1] : sp.slices[2];
+            for (int my = 0; my < chromaHeight; my++)
             {
-                accumSliceOne[ctr] = prev + cdSliceOne[ctr];
-                prev = accumSliceOne[ctr];
-
-                // if (ctr % cdWidth == 0)//imageData.sensor_width < 4)
-                // {
-                //     accumSliceOne[ctr] = -2000;
-                // }
-                // else
-                // {
-                //     accumSliceOne[ctr] = -2000;
-                // }
-                // if (false)
-                // {
-                //     accumSliceOne[ctr] = cdSliceOne[ctr];
-                // }
-                // else if (i % 2) // Even rows: 0, 2, 4,
-                // {
-                //     accumSliceOne[ctr] = prevRG[j%2] + cdSliceOne[ctr];
-                //     prevRG[j%2] = accumSliceOne[ctr];
-
-                //     // Save the first two channel entries for every line
-                //     if (j == 2)
-                //         lineBegRG[0] = accumSliceOne[ctr];
-                //     if (j == 3)
-                //         lineBegRG[1] = accumSliceOne[ctr];
-                // }
-                // else // Odd rows
-                // {
-                //     accumSliceOne[ctr] = prevGB[j%2] + cdSliceOne[ctr];
-                //     prevGB[j%2] = accumSliceOne[ctr];
-
-                //     // Save the first two channel entries for every line
-                //     if (j == 2)
-                //         lineBegGB[0] = accumSliceOne[ctr];
-                //     if (j == 3)
-                //         lineBegGB[1] = accumSliceOne[ctr];
-                // }
-
-
-                ctr++;
+                for (int mx = x0/2; mx < (x0 + sliceWidth)/2; mx++)
+                {
+                    for (int v = 0; v < sp.lumaV; v++)
+                    {
+                        scanValues[n++] = planes[0][long(my*sp.lumaV + v)*W + 2*mx];
+                        scanValues[n++] = planes[0][long(my*sp.lumaV + v)*W + 2*mx + 1];
+                    }
+                    scanValues[n++] = planes[1][long(my)*chromaWidth + mx];
+                    scanValues[n++] = planes[2][long(my)*chromaWidth + mx];
+                }
+            }
+            x0 += sliceWidth;
+        }
+
+        // The RGB as dcraw computes it: the chroma of the odd rows of 4:2:0 is the mean of the rows above and below
+        // and that of the odd columns the mean of its left and right neighbours, the last row and column copying
+        // theirs, then R = Y + Cr, G = Y + (-778 Cb - 2048 Cr)/4096 and B = Y + Cb clipped to 16 bits
+        std::vector<int> chroma [2] = { std::vector<int>(W), std::vector<int>(W) };
+        for (int y = 0; y < H; y++)
+        {
+            for (int c = 0; c < 2; c++)
+            {
+                const uint16_t * plane = &planes[c + 1][0];
+                int above = y/sp.lumaV, below = sp.lumaV == 2 && (y & 1) && y + 1 < H ? above + 1 : above;
+                for (int x = 0; x < W; x += 2)
+                    chroma[c][x] = (plane[long(above)*chromaWidth + x/2] - 16384 + plane[long(below)*chromaWidth + x/2] - 16384 + 1) >> 1;
+                for (int x = 1; x < W; x += 2)
+                    chroma[c][x] = x + 1 < W ? (chroma[c][x - 1] + chroma[c][x + 1] + 1) >> 1 : chroma[c][x - 1];
+            }
+            for (int x = 0; x < W; x++)
+            {
+                int Y = planes[0][long(y)*W + x], Cb = chroma[0][x], Cr = chroma[1][x];
+                int rgb [3] = { Y + Cr, Y + ((-778*Cb - 2048*Cr) >> 12), Y + Cb };
+                for (int i = 0; i < 3; i++)
+                    photosites[3*(long(y)*W + x) + i] = rgb[i] < 0 ? 0 : (rgb[i] > 65535 ? 65535 : rgb[i]);
             }
         }
     }
+    else
+    {
+        // The component of a photosite is its place in the scan line, which the slices decide: per column, where its
+        // slice starts in the scan less the column of the slice, and the slice width
+        std::vector<long> colBase(W);
+        std::vector<int>  colWidth(W);
+        for (int s = 0, x0 = 0; s <= sp.slices[0]; s++)
+        {
+            int sliceWidth = s < sp.slices[0] ? sp.slices[1] : sp.slices[2];
+            for (int x = x0; x < x0 + sliceWidth; x++)
+                colBase[x] = long(s)*sp.slices[1]*H - x0, colWidth[x] = sliceWidth;
+            x0 += sliceWidth;
+        }
 
-    printf("converting to uchar\n");
+        for (int y = 0; y < H; y++)
+        {
+            for (int x = 0; x < W; x++)
+            {
+                rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+                int v = black + (x*7 + y*13) % (ramp > 0 ? ramp : 1) + channelOffset[(y & 1)*2 + (x & 1)];
+                int component = (colBase[x] + long(y)*colWidth[x] + x) % W % numComp;
+                int noise = sp.tables[component] ? 4*sp.noise : sp.noise;
+                if (noise > 0)
+                    v += int(rng % (2*noise + 1)) - noise;
+                photosites[long(y)*W + x] = v < 0 ? 0 : (v > maxValue ? maxValue : v);
+            }
+        }
 
-    int min, max, absmax;
-    getMinMax(&min, &max, accumSliceOne, 0, cdLen);
-    printf("the Bayer (min,max) = (%d, %d)\n", min, max);
-    absmax = (abs(min) > abs(max)) ? abs(min) : abs(max) ;
-    printf("Absmax = %d\n", absmax);
+        // Scan order, the slices one after the other
+        long n = 0;
+        for (int s = 0, x0 = 0; s <= sp.slices[0]; s++)
+        {
+            int sliceWidth = s < sp.slices[0] ? sp.slices[1] : sp.slices[2];
+            for (int y = 0; y < H; y++)
+            {
+                memcpy(&scanValues[n], photosites + long(y)*W + x0, sliceWidth*sizeof(uint16_t));
+                n += sliceWidth;
+            }
+            x0 += sliceWidth;
+        }
+    }
 
-    uchar * accum = new uchar [cdLen];
-    for (int i = 0; i < cdLen; i++)
+    // The predictor differences, the first sample of a component in a line predicted from the one above it
+    std::vector<int> diffs(numSamples);
+    long histogram [2][15] = {{0}};
+    for (long i = 0; i < numSamples; i++)
     {
-        accum[i] = toUChar(accumSliceOne[i], absmax);
+        int col = i % lineWidth, k = col % mcuSamples;
+        int pred = col >= back[k] ? scanValues[i - back[k]] : (i < lineWidth ? 1 << (precision - 1) : scanValues[i - lineWidth]);
+        int d = scanValues[i] - pred;
+        diffs[i] = d;
+        histogram[sp.tables[mcuComp[k]]][d ? 32 - __builtin_clz(abs(d)) : 0]++;
     }
 
-    // =====================================================================
-    // CLOSING FILE
-    // =====================================================================
+    // Table 1 is only built for the components that use it, otherwise both tables are the same
+    bool twoTables = false;
+    for (int c = 0; c < numComp; c++)
+        twoTables = twoTables || sp.tables[c];
+    uint8_t huffData [2][16], huffValues [2][15];
+    uint16_t codeOf [2][15];
+    int lenOf [2][15];
+    for (int t = 0; t < 2; t++)
+    {
+        synthHuffman(histogram[twoTables ? t : 0], huffData[t], huffValues[t]);
+        for (int L = 1, code = 0, k = 0; L <= 16; L++, code <<= 1)
+        {
+            for (int j = 0; j < huffData[t][L - 1]; j++, code++, k++)
+            {
+                codeOf[t][huffValues[t][k]] = code;
+                lenOf[t][huffValues[t][k]]  = L;
+            }
+        }
+    }
 
-    fclose(fp);
+    // Entropy coded scan with stuffed zero bytes after 0xFF, padded with ones
+    std::vector<uint8_t> raw;
+    putBE16(raw, 0xFFD8);
+    putBE16(raw, 0xFFC4);
+    putBE16(raw, 2 + 2*(1 + 16 + 15));
+    for (int t = 0; t < 2; t++)
+    {
+        raw.push_back(t);
+        raw.insert(raw.end(), huffData[t], huffData[t] + 16);
+        raw.insert(raw.end(), huffValues[t], huffValues[t] + 15);
+    }
+    putBE16(raw, 0xFFC3);
+    putBE16(raw, 8 + 3*numComp);
+    raw.push_back(precision);
+    putBE16(raw, numLines);
+    putBE16(raw, lineWidth/mcuSamples);
+    raw.push_back(numComp);
+    for (int c = 0; c < numComp; c++)
+        raw.push_back(c + 1), raw.push_back(sraw && c == 0 ? 0x20 | sp.lumaV : 0x11), raw.push_back(0);
+    putBE16(raw, 0xFFDA);
+    putBE16(raw, 6 + 2*numComp);
+    raw.push_back(numComp);
+    for (int c = 0; c < numComp; c++)
+        raw.push_back(c + 1), raw.push_back(sp.tables[c] << 4);
+    raw.push_back(1); // Predictor 1
+    raw.push_back(0);
+    raw.push_back(0);
+
+    uint64_t bitBuffer = 0;
+    int bitCount = 0;
+    for (long i = 0; i < numSamples + 1; i++)
+    {
+        int d = i < numSamples ? diffs[i] : 0;
+        int ssss = d ? 32 - __builtin_clz(abs(d)) : 0;
+        int t    = i < numSamples ? sp.tables[mcuComp[i % lineWidth % mcuSamples]] : 0;
+        int padBits   = (8 - bitCount % 8) % 8;
+        uint32_t bits = i < numSamples ? codeOf[t][ssss] : (1 << padBits) - 1;
+        int numBits   = i < numSamples ? lenOf[t][ssss] : padBits;
+        if (i < numSamples && ssss)
+        {
+            bits = (bits << ssss) | ((d > 0 ? d : d + (1 << ssss) - 1) & ((1 << ssss) - 1));
+            numBits += ssss;
+        }
+        bitBuffer = (bitBuffer << numBits) | bits;
+        bitCount += numBits;
+        while (bitCount >= 8)
+        {
+            uint8_t byte = uint8_t(bitBuffer >> (bitCount - 8));
+            bitCount -= 8;
+            raw.push_back(byte);
+            if (byte == 0xFF)
+                raw.push_back(0x00);
+        }
+    }
+    putBE16(raw, 0xFFD9);
+
+    // TIFF structure, the IFDs first and the data they point to after them
+    static const char make [] = "Canon";
+    static const char model [] = "Canon EOS SYNTHETIC";
+    const long ifd0 = 16, numIfd0 = 5;
+    const long exif = ifd0 + 2 + 12*numIfd0 + 4, numExif = 3;
+    const long makernote = exif + 2 + 12*numExif + 4, numMakernote = 1;
+    const long rawIfd = makernote + 2 + 12*numMakernote + 4, numRawIfd = 4;
+    const long data = rawIfd + 2 + 12*numRawIfd + 4;
+    const long makeAt = data, modelAt = makeAt + 8, exposureAt = modelAt + 24, fNumberAt = exposureAt + 8;
+    const long sensorAt = fNumberAt + 8, sliceAt = sensorAt + 2*17;
+    const long rawAt = (sliceAt + 6 + 15) & ~15L;
+
+    std::vector<uint8_t> out;
+    out.push_back('I'), out.push_back('I');
+    put16(out, 42);
+    put32(out, ifd0);
+    out.push_back('C'), out.push_back('R'), out.push_back(2), out.push_back(0);
+    put32(out, rawIfd);
+
+    put16(out, numIfd0);
+    putTag(out, IMAGE_WIDTH, 3, 1, W);
+    putTag(out, IMAGE_LENGTH, 3, 1, H);
+    putTag(out, MAKE, 2, sizeof(make), makeAt);
+    putTag(out, MODEL, 2, sizeof(model), modelAt);
+    putTag(out, EXIF, 4, 1, exif);
+    put32(out, 0);
+
+    put16(out, numExif);
+    putTag(out, EXPOSURE_TIME, 5, 1, exposureAt);
+    putTag(out, F_NUMBER, 5, 1, fNumberAt);
+    putTag(out, MAKERNOTE, 7, 2 + 12*numMakernote + 4, makernote);
+    put32(out, 0);
+
+    put16(out, numMakernote);
+    putTag(out, SENSOR_INFO, 3, 17, sensorAt);
+    put32(out, 0);
+
+    put16(out, numRawIfd);
+    putTag(out, COMPRESSION, 3, 1, 6);
+    putTag(out, STRIP_OFFSET, 4, 1, rawAt);
+    putTag(out, STRIP_BYTE_COUNTS, 4, 1, raw.size());
+    putTag(out, CR2_SLICE, 3, 3, sliceAt);
+    put32(out, 0);
+
+    out.insert(out.end(), make, make + sizeof(make));
+    out.resize(modelAt, 0);
+    out.insert(out.end(), model, model + sizeof(model));
+    out.resize(exposureAt, 0);
+    put32(out, 1), put32(out, 125);
+    put32(out, 56), put32(out, 10);
+
+    int leftBorder = W > 256 ? 84 : 0, topBorder = H > 128 ? 50 : 0;
+    uint16_t sensor [17] = { 34, uint16_t(W), uint16_t(H), 0, 0, uint16_t(leftBorder), uint16_t(topBorder), uint16_t(W - 1), uint16_t(H - 1) };
+    for (int i = 0; i < 17; i++)
+        put16(out, sensor[i]);
+    for (int i = 0; i < 3; i++)
+        put16(out, slices[i]);
+    out.resize(rawAt, 0);
+    out.insert(out.end(), raw.begin(), raw.end());
 
-    // =====================================================================
-    // Writing channel data to file
-    // =====================================================================
+    FILE * filep = fopen(fname, "wb");
+    if (filep == NULL)
+    {
+        printf("Error in writeSynthCr2(): cannot open \"%s\"\n", fname);
+        return false;
+    }
+    bool ok = fwrite(&out[0], 1, out.size(), filep) == out.size();
+    fclose(filep);
+    return ok;
+}
 
-    toFile(out_fname, accum, cdWidth, cdHeight);
+// ==================================================================================================================================================================================================
+// 16 bit image writers
+// ==================================================================================================================================================================================================
 
+int imageFormat(const char * fname)
+{
+    const char * dot = strrchr(fname, '.');
+    if (dot == NULL)
+        return FORMAT_DAT;
+    if (strcasecmp(dot, ".pgm") == 0 || strcasecmp(dot, ".ppm") == 0 || strcasecmp(dot, ".pnm") == 0)
+        return FORMAT_PNM;
+    if (strcasecmp(dot, ".tif") == 0 || strcasecmp(dot, ".tiff") == 0)
+        return FORMAT_TIFF;
+    return FORMAT_DAT;
 }
 
-void cubicInterpol(int * output, int * input)
+const char * imageExtension(int format, int channels)
 {
-    double y1 = input[1];
-    double y2 = input[2];
-    double y3 = input[3];
-    double y4 = input[4];
+    if (format == FORMAT_PNM)
+        return channels == 3 ? ".ppm" : ".pgm";
+    if (format == FORMAT_TIFF)
+        return ".tif";
+    return ".dat";
+}
 
-    for (int x = 2; x < 4; x++)
+// The 16 bit samples of PGM/PPM are big endian, dst does not need to be aligned
+void swapBytes16(uint8_t * dst, const uint16_t * src, long n)
+{
+    long i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= n; i += 8)
     {
-        double temp = - (1.0/42.0)*(x - 7.0)*(x - 6.0)*(x - 1.0)*y1 
-                      + (1.0/30.0)*(x - 7.0)*(x - 6.0)*x*y2
-                      - (1.0/30.0)*(x - 7.0)*(x - 1.0)*x*y3
-                      + (1.0/42.0)*(x - 6.0)*(x - 1.0)*x*y4;
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + 2*i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        dst[2*i + 0] = src[i] >> 8;
+        dst[2*i + 1] = src[i] & 0xFF;
+    }
+}
 
-        output[x - 2] = int(1.0*temp);    
+bool writeAll(int fd, const uint8_t * data, long size)
+{
+    while (size > 0)
+    {
+        long n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
     }
+    return true;
 }
 
-int getDiffValue(uint16_t code, int len)
+bool ImageWriter::open(const char * fname, int format, int width, int height, int channels, int maxValue)
+{
+    this->format   = format;
+    this->width    = width;
+    this->height   = height;
+    this->channels = channels;
+    this->maxValue = maxValue;
+    rowsWritten = 0;
+    failed      = false;
+    current     = 0;
+    fill        = 0;
+    pendingSize = 0;
+    closing     = false;
+
+    fd = ::open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Error in ImageWriter::open(): could not create \"%s\"\n", fname);
+        return false;
+    }
+
+    for (int b = 0; b < 2; b++)
+    {
+        if (posix_memalign((void **) &buffers[b], WRITER_ALIGN, WRITER_BUFFER_SIZE) != 0)
+            buffers[b] = NULL;
+    }
+    if (buffers[0] == NULL || buffers[1] == NULL)
+    {
+        printf("Error in ImageWriter::open(): could not allocate the write buffers\n");
+        free(buffers[0]);
+        free(buffers[1]);
+        buffers[0] = buffers[1] = NULL;
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    stats.alloc(2*WRITER_BUFFER_SIZE);
+
+    header();
+    thread = std::thread(&ImageWriter::writerLoop, this);
+    return true;
+}
+
+void ImageWriter::header()
 {
-    return (code >= (1 << len -1) ? code : (code - (1 << len) + 1)) ;
+    std::vector<uint8_t> out;
+    if (format == FORMAT_PNM)
+    {
+        char text [64];
+        int n = snprintf(text, sizeof(text), "P%d\n%d %d\n%d\n", channels == 3 ? 6 : 5, width, height, maxValue);
+        out.assign(text, text + n);
+    }
+    else if (format == FORMAT_TIFF)
+    {
+        // The IFD and the arrays it points to come first, the strips follow back to back. Arrays of one value are
+        // stored in the tag itself, as are BitsPerSample of one sample.
+        const int numTags = 13;
+        int numStrips = (height + TIFF_STRIP_ROWS - 1)/TIFF_STRIP_ROWS;
+        uint32_t stripBytes = uint32_t(TIFF_STRIP_ROWS)*width*channels*sizeof(uint16_t);
+        uint32_t lastBytes  = uint32_t(height - (numStrips - 1)*TIFF_STRIP_ROWS)*width*channels*sizeof(uint16_t);
+
+        uint32_t bitsAt    = 8 + 2 + 12*numTags + 4;
+        uint32_t resAt     = bitsAt + (channels > 1 ? 2*channels : 0);
+        uint32_t offsetsAt = resAt + 8;
+        uint32_t countsAt  = offsetsAt + (numStrips > 1 ? 4*numStrips : 0);
+        uint32_t dataAt    = countsAt  + (numStrips > 1 ? 4*numStrips : 0);
+
+        out.push_back('I');
+        out.push_back('I');
+        put16(out, 42);
+        put32(out, 8);
+
+        put16(out, numTags);
+        putTag(out, IMAGE_WIDTH, 4, 1, width);
+        putTag(out, IMAGE_LENGTH, 4, 1, height);
+        putTag(out, BITS_PER_SAMPLE, 3, channels, channels > 1 ? bitsAt : 16);
+        putTag(out, COMPRESSION, 3, 1, 1);
+        putTag(out, PHOTOMETRIC_INTERPRETATION, 3, 1, channels == 3 ? 2 : 1);
+        putTag(out, STRIP_OFFSET, 4, numStrips, numStrips > 1 ? offsetsAt : dataAt);
+        putTag(out, SAMPLES_PER_PIXEL, 3, 1, channels);
+        putTag(out, ROWS_PER_STRIP, 4, 1, TIFF_STRIP_ROWS);
+        putTag(out, STRIP_BYTE_COUNTS, 4, numStrips, numStrips > 1 ? countsAt : lastBytes);
+        putTag(out, X_RESOLUTION, 5, 1, resAt);
+        putTag(out, Y_RESOLUTION, 5, 1, resAt);
+        putTag(out, PLANAR_CONFIGURATION, 3, 1, 1);
+        putTag(out, RESOLUTION_UNIT, 3, 1, 1);
+        put32(out, 0);
+
+        for (int c = 0; c < channels && channels > 1; c++)
+            put16(out, 16);
+        put32(out, 1);
+        put32(out, 1);
+        for (int i = 0; i < numStrips && numStrips > 1; i++)
+            put32(out, dataAt + i*stripBytes);
+        for (int i = 0; i < numStrips && numStrips > 1; i++)
+            put32(out, i < numStrips - 1 ? stripBytes : lastBytes);
+    }
+    else
+    {
+        out.resize(2*sizeof(int));
+        memcpy(&out[0], &width, sizeof(int));
+        memcpy(&out[sizeof(int)], &height, sizeof(int));
+    }
+
+    memcpy(buffers[current], &out[0], out.size());
+    fill = out.size();
 }
 
-void getDiffValues(int * diffOut, ImData im)
+void ImageWriter::writeRows(const uint16_t * rows, int numRows)
 {
-    // Retrieve huffman codes
-    uint16_t codes [16];
-    huffCodes(im.huffData, codes);
+    if (frameStats)
+        frameStats->addRows(rows, rowsWritten, numRows);
 
-    uint16_t minLen = 0;
-    uint16_t maxLen = 0;
-    uint16_t numCodes = 0;
-    for (int i = 0; i < 16; i++)
+    long n = long(numRows)*width*channels;
+    while (n > 0)
     {
-        numCodes += im.huffData[i];
+        long room = (WRITER_BUFFER_SIZE - fill)/sizeof(uint16_t);
+        long m = n < room ? n : room;
+        if (format == FORMAT_PNM)
+            swapBytes16(buffers[current] + fill, rows, m);
+        else
+            memcpy(buffers[current] + fill, rows, m*sizeof(uint16_t));
+        fill += m*sizeof(uint16_t);
+        rows += m;
+        n    -= m;
+
+        // The PGM/PPM header can leave an odd byte at the end of a buffer
+        if (WRITER_BUFFER_SIZE - fill < long(sizeof(uint16_t)))
+            flush();
+    }
+    rowsWritten += numRows;
+}
 
-        if (minLen == 0 && im.huffData[i] != 0)
-            minLen = i + 1;
+void ImageWriter::rowsReady(const uint16_t * image, int numRows)
+{
+    // image holds the whole image, the rows before numRows are final
+    if (numRows > rowsWritten)
+        writeRows(image + long(rowsWritten)*width*channels, numRows - rowsWritten);
+}
 
-        if (maxLen < i + 1 && im.huffData[i] != 0)
-            maxLen = i + 1;
+void ImageWriter::flush()
+{
+    // Hands the current buffer to the writer thread once it is done with the other one
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait(guard, [this]() { return pendingSize == 0; });
+    pendingSize = fill;
+    current ^= 1;
+    fill = 0;
+    cond.notify_all();
+}
+
+void ImageWriter::writerLoop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        cond.wait(guard, [this]() { return pendingSize > 0 || closing; });
+        if (pendingSize == 0)
+            break;
+
+        const uint8_t * data = buffers[current ^ 1];
+        long size = pendingSize;
+        guard.unlock();
+        bool ok = writeAll(fd, data, size);
+        guard.lock();
+
+        failed = failed || !ok;
+        pendingSize = 0;
+        cond.notify_all();
     }
+}
 
-    uint16_t lenTab [numCodes];
-    uint16_t ccounter = 0;
-    for (int i = 0; i < 16; i++)
+bool ImageWriter::close()
+{
+    if (fd < 0)
+        return false;
+
+    if (rowsWritten != height)
     {
-        uint16_t HD = im.huffData[i];
-        for (int n = 0; n < HD; n++)
-        {
-            lenTab[ccounter] = i+1;
-            ccounter ++;
-        }
+        printf("Warning in ImageWriter::close(): %d of %d rows were written\n", rowsWritten, height);
+        failed = true;
+    }
+    if (fill)
+        flush();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
     }
+    cond.notify_all();
+    thread.join();
+
+    if (::close(fd) != 0)
+        failed = true;
+    fd = -1;
+    free(buffers[0]);
+    free(buffers[1]);
+    buffers[0] = buffers[1] = NULL;
+    stats.release(2*WRITER_BUFFER_SIZE);
+
+    if (failed)
+        printf("\n error writing to file \n");
+    return !failed;
+}
+
+// ==================================================================================================================================================================================================
+// Kernel benchmarks
+// ==================================================================================================================================================================================================
 
-    printf("did we get the codes?\n\n");
-    for (int i = 0; i < 15; i++)
+// Fastest of reps runs of a kernel, in seconds
+template <typename F>
+double benchBest(int reps, F kernel)
+{
+    double best = 1e30;
+    for (int r = 0; r < reps; r++)
     {
-        printBits(codes[i]); printf("\n");
+        double start = monotonicSeconds();
+        kernel();
+        double t = monotonicSeconds() - start;
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+void benchReport(FILE * report, const char * kernel, double seconds, long samples, long bytes)
+{
+    printf("%-28s %12.3f %12.3f %12.1f\n", kernel, 1e3*seconds, 1e9*seconds/samples, bytes/seconds/1e6);
+    if (report)
+        fprintf(report, "%s,%.6f,%.4f,%.2f\n", kernel, 1e3*seconds, 1e9*seconds/samples, bytes/seconds/1e6);
+}
+
+int runBench(const char * in_fname, const char * report_fname, DecodeOptions opts)
+{
+    // MB/s is of the bytes each kernel reads: the scan for the entropy decoders, the frame for the others
+    InputFile input;
+    if (!input.open(in_fname, opts.mmap))
+    {
+        printf("The file \"%s\" cannot be located or successfully opened!\n", in_fname);
+        return 1;
+    }
+    ImData im;
+    im.input = &input;
+    if (!parseHeaders(&im, false))
+    {
+        printf("The file \"%s\" is not a CR2 file that can be decoded!\n", in_fname);
+        input.close();
+        return 1;
     }
 
+    FILE * report = fopen(report_fname, "w");
+    if (report == NULL)
+        printf("Warning in runBench(): cannot write \"%s\", printing only\n", report_fname);
+    else
+        fprintf(report, "kernel,ms,ns_per_sample,mb_per_s\n");
+
+    int reps = opts.benchReps > 0 ? opts.benchReps : 1;
+    long frame = long(im.sensor_width)*im.sensor_height;
+    long scanBytes = im.raw_scan_size;
+    opts.quiet = true;
+
+    printf("Benchmarking %s, %dx%d, %ld scan bytes, best of %d\n\n", in_fname, im.sensor_width, im.sensor_height, scanBytes, reps);
+    printf("%-28s %12s %12s %12s\n", "kernel", "ms", "ns/sample", "MB/s");
+
+    uint16_t codes [HUFF_MAX_VALUES];
+    const int numTables = 100000;
+    double t = benchBest(reps, [&]() { for (int i = 0; i < numTables; i++) huffCodes(im.huffData, codes); });
+    benchReport(report, "huffCodes", t/numTables, 1, 16);
+
+    HuffTable table;
+    t = benchBest(reps, [&]() { for (int i = 0; i < numTables/10; i++) table.build(im.huffData, im.huffValues); });
+    benchReport(report, "HuffTable::build", t/(numTables/10), 1, 16);
+
     ByteStream bstream;
-    fseek(im.file, im.raw_scan_offset, SEEK_SET);
-    bstream.loadBytes(im.file, im.raw_scan_size);
-    fseek(im.file, im.raw_scan_offset, SEEK_SET);
+    loadScan(&bstream, im);
+    volatile uint32_t sink = 0;
+    t = benchBest(reps, [&]() 
+    {
+        bstream.byteLoc = 0, bstream.bitBuffer = 0, bstream.bitStart = 32;
+        uint32_t sum = 0;
+        for (long i = 0; i < scanBytes/2; i++)
+            sum += bstream.readBits(16);
+        sink = sum;
+    });
+    benchReport(report, "ByteStream::readBits", t, frame, scanBytes);
+
+    BitPump pump;
+    t = benchBest(reps, [&]() { pump.load(bstream.bytes, bstream.size, opts.simd); });
+    benchReport(report, "BitPump::load (unstuff)", t, frame, scanBytes);
+    bstream.release();
+
+    int * diffs = new int [frame];
+    t = benchBest(reps, [&]() { getDiffValues(diffs, im, opts); });
+    benchReport(report, "getDiffValues", t, frame, scanBytes);
+
+    DecodeOptions legacy = opts;
+    legacy.legacyBits = true;
+    t = benchBest(reps, [&]() { getDiffValues(diffs, im, legacy); });
+    benchReport(report, "getDiffValues (legacy bits)", t, frame, scanBytes);
+
+    // The band chain of --bands must integrate the same slice as the full frame decode, checked on the second slice
+    // (or the only one) cropped to 1728 columns like main does
+    {
+        getDiffValues(diffs, im, opts);
+        int slice = im.cr2_slice[0] > 0 ? 1 : 0;
+        int sliceWidth = slice < im.cr2_slice[0] ? im.cr2_slice[1] : im.cr2_slice[2];
+        int cropRight = sliceWidth < 1728 ? sliceWidth : 1728;
+        DecodeOptions bandOpts = opts;
+        bandOpts.bandRows = opts.bandRows > 0 ? opts.bandRows : 64;
+
+        BandCollector collect;
+        AccumulateStage accumulate(&collect);
+        SliceCropStage crop(slice, 0, cropRight, bandOpts.bandRows, &accumulate);
+        decodeBands(im, bandOpts, &crop);
+
+        const int * sliceStart = diffs + long(slice)*im.cr2_slice[1]*im.sensor_height;
+        std::vector<int> row(cropRight);
+        bool match = long(collect.values.size()) == long(cropRight)*im.sensor_height;
+        for (int i = 0; match && i < im.sensor_height; i++)
+        {
+            accumulateRow(&row[0], sliceStart + long(i)*sliceWidth, cropRight, 20000);
+            match = memcmp(&row[0], &collect.values[long(i)*cropRight], cropRight*sizeof(int)) == 0;
+        }
+        printf("%-28s %12s\n", "decodeBands matches", match ? "yes" : "NO");
+    }
 
-    int numDiffValues = im.sensor_width * im.sensor_height;
+    // The SSE2 kernel of srawRgbRow against its scalar tail, which converts the row one pixel at a time, on samples over
+    // the whole range so that both clips are hit
+    {
+        const int width = 8*64 + 5;
+        std::vector<uint16_t> luma(width), rgb(3*width), tail(3*width);
+        std::vector<int16_t> cb(width), cr(width);
+        uint32_t rng = 1;
+        for (int x = 0; x < width; x++)
+        {
+            rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+            luma[x] = uint16_t(rng);
+            cb[x]   = int16_t(rng >> 16);
+            rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+            cr[x]   = int16_t(rng >> 8);
+        }
+        srawRgbRow(&rgb[0], &luma[0], &cb[0], &cr[0], width);
+        for (int x = 0; x < width; x++)
+            srawRgbRow(&tail[3*x], &luma[x], &cb[x], &cr[x], 1);
+        printf("%-28s %12s\n", "srawRgbRow SSE2 matches", rgb == tail ? "yes" : "NO");
+    }
 
-    uint16_t remainder = 0;
-    uint16_t remLen = 0;
-    uint16_t CodeBitBuffer;
+    uint16_t * photosites = new uint16_t [frame];
+    t = benchBest(reps, [&]() { decodePhotosites(photosites, im, opts, NULL); });
+    benchReport(report, "decodePhotosites", t, frame, scanBytes);
+
+    Cr2Decoder decoder;
+    decoder.opts = opts;
+    t = benchBest(reps, [&]() { decoder.open(in_fname); decoder.decode(photosites, NULL); });
+    benchReport(report, "Cr2Decoder open+decode", t, frame, scanBytes);
+
+    uint16_t * scanValues = new uint16_t [frame];
+    ScanDecoder scan;
+    scan.begin(im, opts);
+    scan.decodeLines(scanValues, im.num_lines);
+    t = benchBest(reps, [&]() { unslice(photosites, scanValues, im); });
+    benchReport(report, "unslice", t, frame, frame*sizeof(uint16_t));
+
+    uint16_t * rgb = new uint16_t [3*frame];
+    int maxValue = (1 << im.precision) - 1;
+    DecodeOptions demosaicOpts = opts;
+    demosaicOpts.demosaic = DEMOSAIC_BILINEAR;
+    t = benchBest(reps, [&]() { demosaic(rgb, photosites, im.sensor_width, im.sensor_height, maxValue, demosaicOpts); });
+    benchReport(report, "demosaic bilinear", t, frame, frame*sizeof(uint16_t));
+    demosaicOpts.demosaic = DEMOSAIC_PPG;
+    t = benchBest(reps, [&]() { demosaic(rgb, photosites, im.sensor_width, im.sensor_height, maxValue, demosaicOpts); });
+    benchReport(report, "demosaic ppg", t, frame, frame*sizeof(uint16_t));
+    delete [] rgb;
+
+    int * rows = new int [frame];
+    t = benchBest(reps, [&]() { memcpy(rows, diffs, frame*sizeof(int)); accumulateRows(rows, im.sensor_width, im.sensor_height); });
+    benchReport(report, "accumulateRows (with copy)", t, frame, frame*sizeof(int));
+
+    t = benchBest(reps, [&]() { memcpy(rows, diffs, frame*sizeof(int)); integrateBayerRows(rows, im.sensor_width, im.sensor_height, 2, 0); });
+    benchReport(report, "integrateBayerRows int32", t, frame, frame*sizeof(int));
+
+    int16_t * rows16 = new int16_t [frame];
+    for (long i = 0; i < frame; i++)
+        rows16[i] = diffs[i];
+    int16_t * work16 = new int16_t [frame];
+    t = benchBest(reps, [&]() { memcpy(work16, rows16, frame*sizeof(int16_t)); integrateBayerRows(work16, im.sensor_width, im.sensor_height, 2, 0); });
+    benchReport(report, "integrateBayerRows int16", t, frame, frame*sizeof(int16_t));
+
+    // Both variants against a plain x[j] += x[j-2] over the same differences, the int16 one modulo 2^16
+    {
+        int width = im.sensor_width;
+        std::vector<int> integrated(diffs, diffs + frame);
+        for (int i = 0; i < im.sensor_height; i++)
+        {
+            int * x = &integrated[long(i)*width];
+            const int * above = i < 2 ? NULL : x - 2L*width;
+            for (int j = 0; j < width; j++)
+                x[j] += j >= 2 ? x[j - 2] : (above ? above[j] : 0);
+        }
+        bool match32 = memcmp(rows, &integrated[0], frame*sizeof(int)) == 0;
+        bool match16 = true;
+        for (long i = 0; match16 && i < frame; i++)
+            match16 = work16[i] == int16_t(integrated[i]);
+        printf("%-28s %12s\n", "int32 integration matches", match32 ? "yes" : "NO");
+        printf("%-28s %12s\n", "int16 integration matches", match16 ? "yes" : "NO");
+    }
+    delete [] rows16;
+    delete [] work16;
+
+    int min, max;
+    t = benchBest(reps, [&]() { getMinMax(&min, &max, rows, 0, frame); });
+    benchReport(report, "getMinMax", t, frame, frame*sizeof(int));
+    int absmax = abs(min) > abs(max) ? abs(min) : abs(max);
+
+    uchar * bytes = new uchar [frame];
+    t = benchBest(reps, [&]() { for (long i = 0; i < frame; i++) bytes[i] = toUChar(rows[i], absmax); });
+    benchReport(report, "toUChar", t, frame, frame*sizeof(int));
+    t = benchBest(reps, [&]() { toUCharRow(bytes, rows, frame, absmax); });
+    benchReport(report, "toUCharRow", t, frame, frame*sizeof(int));
+    std::string tmpName = std::string(report_fname) + ".tmp";
+    t = benchBest(reps, [&]() { toFile(tmpName.c_str(), bytes, im.sensor_width, im.sensor_height); });
+    benchReport(report, "toFile", t, frame, frame);
+    remove(tmpName.c_str());
+
+    delete [] diffs;
+    delete [] photosites;
+    delete [] scanValues;
+    delete [] rows;
+    delete [] bytes;
+    if (report)
+        fclose(report);
+    input.close();
+    return 0;
+}
+
+// ==================================================================================================================================================================================================
+// Streaming decode in row bands
+// ==================================================================================================================================================================================================
 
+void decodeBands(ImData im, DecodeOptions opts, BandConsumer * consumer)
+{
+    int width  = im.sensor_width;
+    int height = im.sensor_height;
+
+    // The scan is streamed, so besides the bands only two chunks of it are held
+    ScanDecoder scan;
+    scan.beginStream(im, opts);
+    consumer->begin(im, width);
+
+    // The row starts are treated as getDiffValues does, the seam correction reads the end of the row before the band
+    // from the 4 values kept in front of it
+    const SeamModel * seam = seamModel(im, opts.seamCorrect);
+    int corrected = 0;
+
+    Band band;
+    band.width = width;
+    int * buffer = new int [4 + opts.bandRows*width];
+    band.data = buffer + 4;
+    for (band.firstRow = 0; band.firstRow < height; band.firstRow += band.numRows)
+    {
+        band.numRows = height - band.firstRow < opts.bandRows ? height - band.firstRow : opts.bandRows;
+        stats.start(STAGE_ENTROPY);
+        scan.decode(band.data, band.numRows*width);
+        stats.stop(STAGE_ENTROPY);
+
+        stats.start(STAGE_CORRECTION);
+        corrected += fixRowStarts(band.data, width, band.firstRow, band.numRows, seam);
+        stats.stop(STAGE_CORRECTION);
+
+        // The consumers may change the band in place
+        memcpy(buffer, band.data + long(band.numRows)*width - 4, 4*sizeof(int));
+        consumer->consume(band);
+    }
+    delete [] buffer;
+    if (seam && !opts.quiet)
+        printf("Corrected the seam at the start of %d rows\n", corrected);
+
+    consumer->finish();
+    stats.count(stats.symbols, long(height)*width);
+    stats.count(stats.markers, scan.pump.markers);
+    stats.count(stats.badCodes, scan.badCodes);
+    stats.count(stats.slowPathHits, scan.huffTable.slowPathHits + scan.huffTable1.slowPathHits);
+}
 
-    int defCount = 0;
-    int * defStatistics[4];
-    int defCounters[4] = {0,0,0,0};
-    for (int i = 0; i < 4; i++)
-        defStatistics[i] = new int [im.sensor_height/2];
+SliceCropStage::SliceCropStage(int slice, int cropLeft, int cropRight, int bandRows, BandConsumer * next)
+    : slice(slice), cropLeft(cropLeft), cropRight(cropRight), bandRows(bandRows), next(next) {}
 
+void SliceCropStage::begin(ImData & im, int /* bandWidth */)
+{
+    int count = im.cr2_slice[0];
+    sliceWidth = slice < count ? im.cr2_slice[1] : im.cr2_slice[2];
+    sliceBase  = long(slice)*im.cr2_slice[1]*im.sensor_height;
+    sliceEnd   = sliceBase + long(sliceWidth)*im.sensor_height;
+    pos = 0;
+
+    out.width    = cropRight - cropLeft;
+    out.firstRow = 0;
+    out.numRows  = 0;
+    out.data     = new int [bandRows*out.width];
+    next->begin(im, out.width);
+}
 
-    for (int i = 0; i < numDiffValues; i++)
+void SliceCropStage::consume(Band & band)
+{
+    // The scan holds the slices one after the other, so a band covers a run of whole and partial slice rows
+    long start = pos;
+    long stop  = pos + long(band.numRows)*band.width;
+    pos = stop;
+
+    long cur = start > sliceBase ? start : sliceBase;
+    long end = stop  < sliceEnd  ? stop  : sliceEnd;
+    while (cur < end)
     {
-        uint16_t slidingBits, code, codeLen, counter, codeValue, tempBits;
-        tempBits = bstream.readBits(maxLen - remLen);
-        CodeBitBuffer = (remainder << (maxLen - remLen)) + tempBits;
-
-        slidingBits = CodeBitBuffer;
-        counter     = numCodes -1;
-        
-        bool foundCode = false;
-        for (int L = maxLen; L > minLen - 1 ; L--)
+        long local = cur - sliceBase;
+        int  row   = local / sliceWidth;
+        int  col   = local % sliceWidth;
+        int  n     = end - cur < sliceWidth - col ? end - cur : sliceWidth - col;
+
+        const int * src = band.data + (cur - start);
+        int * dst = out.data + (row - out.firstRow)*out.width;
+        for (int j = col; j < col + n; j++)
         {
-            for (int N = 0; N < im.huffData[L-1]; N++)
-            {
-                code = codes[counter];
-                if (slidingBits == code)
-                {
-                    foundCode = true;
-                    codeLen   = lenTab[counter];
-                    codeValue = im.huffValues[counter];
-                    break;
-                }
-                counter--;
-            }
-            slidingBits = slidingBits >> 1;
-
-            if (foundCode)
-                break;    
+            if (j >= cropLeft && j < cropRight)
+                dst[j - cropLeft] = src[j - col];
         }
 
-        if (!foundCode)
-            printf("We didn't find code :O :O \n\n");
-
-        uint16_t numNewBits, newBits, diffCode; 
-        int temp, diffValue;
-
-        remainder  = CodeBitBuffer - (code << (maxLen - codeLen) );
-        temp       = codeValue - (maxLen - codeLen); // WOOOPS be aware of overflow, we correct in line below!
-        numNewBits = temp > 0 ? temp : 0;
-
-        if ( numNewBits )
+        cur += n;
+        if (col + n == sliceWidth)
         {
-            newBits = bstream.readBits(numNewBits);
-            diffCode = (remainder << numNewBits) + newBits;
-            remainder = 0;
-            remLen = 0;
-
-            if (i == numDiffValues -1)
+            out.numRows++;
+            if (out.numRows == bandRows)
             {
-                printf("newBits = "); printBits(newBits); printf("\n\n");
+                next->consume(out);
+                out.firstRow += out.numRows;
+                out.numRows = 0;
             }
         }
-        else
-        {
-            diffCode = (remainder >> abs(temp));
-            remainder = remainder - (diffCode << abs(temp));
-            remLen = maxLen - codeLen - codeValue;
-        }
-
-         diffValue = getDiffValue(diffCode, codeValue);
+    }
+}
 
-         int modi_def = i % im.sensor_width;
+void SliceCropStage::finish()
+{
+    if (out.numRows)
+        next->consume(out);
+    delete [] out.data;
+    out.data = NULL;
+    next->finish();
+}
 
-         if ( defCount % 2 && modi_def < 4) // This hits exactly where the defects are
-         {
-             diffOut[i] = diffValue;
-             defStatistics[modi_def][defCounters[modi_def]] = diffValue;
-             defCounters[modi_def] += 1;
-         }
-         if ( modi_def == 0)
-             defCount ++;
-         else
-            diffOut[i] = diffValue;
+void AccumulateStage::consume(Band & band)
+{
+    accumulateRows(band.data, band.width, band.numRows);
+    next->consume(band);
+}
 
+// Running sum of the two interleaved channels of a row, x[j] += x[j-2], starting from the pair seed[0], seed[1]
+inline void prefixSumPairs(int * row, int width, const int * seed)
+{
+    int j = 0;
+    int s0 = seed[0], s1 = seed[1];
+#ifdef __SSE2__
+    // Two pairs per register, the running sum of the last pair is carried to the next register
+    __m128i carry = _mm_setr_epi32(s0, s1, s0, s1);
+    for (; j + 4 <= width; j += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *) (row + j));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, carry);
+        _mm_storeu_si128((__m128i *) (row + j), x);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 2, 3, 2));
     }
-
-    long long defTots[4] = {0,0,0,0};
-    for (int i = 0; i < im.sensor_height/2; i++)
+    s0 = _mm_cvtsi128_si32(carry);
+    s1 = _mm_cvtsi128_si32(_mm_srli_si128(carry, 4));
+#endif
+    for (; j + 1 < width; j += 2)
     {
-        for (int j = 0; j < 4; j++)
-        {
-            defTots[j] += defStatistics[j][i];
-        }
+        row[j]     = s0 += row[j];
+        row[j + 1] = s1 += row[j + 1];
     }
+    if (j < width)
+        row[j] += s0;
+}
 
-    for (int i = 0; i < 4; i++)
+inline void prefixSumPairs(int16_t * row, int width, const int16_t * seed)
+{
+    // Modulo 2^16 like the lossless JPEG predictor, so the values can be read as uint16_t photosites
+    int j = 0;
+    uint16_t s0 = seed[0], s1 = seed[1];
+#ifdef __SSE2__
+    // Four pairs per register, two shift and add steps give the sums within the register
+    __m128i carry = _mm_set1_epi32(int(s0) | (int(s1) << 16));
+    for (; j + 8 <= width; j += 8)
     {
-        printf("defTots[%d] = %d\n", i, defTots[i]);
+        __m128i x = _mm_loadu_si128((const __m128i *) (row + j));
+        x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi16(x, carry);
+        _mm_storeu_si128((__m128i *) (row + j), x);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
     }
-
-    printf("attempting to correct \n");
-    for (int i = 0; i < numDiffValues; i++)
+    uint32_t last = _mm_cvtsi128_si32(carry);
+    s0 = last & 0xFFFF;
+    s1 = last >> 16;
+#endif
+    for (; j + 1 < width; j += 2)
     {
-        int modi_def = i % im.sensor_width;
+        row[j]     = s0 += uint16_t(row[j]);
+        row[j + 1] = s1 += uint16_t(row[j + 1]);
+    }
+    if (j < width)
+        row[j] = uint16_t(row[j]) + s0;
+}
 
-        if (modi_def == 0 && i) // Construct the interpolation
-        {    
-            //    left     interpol    right
-            // R G R G   R G R G    R G R G
-            // 4 3 2 1   0 1 2 3    4 5 6 7
+template <typename T>
+void integrateBayerRows(T * rows, int width, int numRows, int rowPeriod, int seed)
+{
+    // In place integration of difference rows per Bayer channel, the two colors of a row alternate. A row starts
+    // from the first pair of the row rowPeriod rows up: 1 is the row above as the lossless JPEG predictor has it,
+    // 2 the row above with the same colors as the commented out RG/GB code in main. The first rows start from seed.
+    T first [2] = { T(seed), T(seed) };
+    for (int i = 0; i < numRows; i++)
+    {
+        T * row = rows + long(i)*width;
+        prefixSumPairs(row, width, i < rowPeriod ? first : row - long(rowPeriod)*width);
+    }
+}
 
-            int interpolR[2];
-            int interpolG[2];
+void accumulateRows(int * rows, int width, int numRows)
+{
+    // Same integration as the full frame path, every row starts over from 20000
+    for (int i = 0; i < numRows; i++)
+    {
+        int * row = rows + long(i)*width;
+        int prev = 20000;
+        for (int j = 0; j < width; j++)
+        {
+            row[j] += prev;
+            prev = row[j];
+        }
+    }
+}
 
-            int edgesR[4];
-            int edgesG[4];
+// One row of accumulateRows, into sums wider than the stored difference values
+template <typename T>
+void accumulateRow(int * sums, const T * diffs, int width, int start)
+{
+    int prev = start;
+    for (int j = 0; j < width; j++)
+    {
+        prev += diffs[j];
+        sums[j] = prev;
+    }
+}
 
-            // Left
-            edgesR[0] = diffOut[i-4];
-            edgesG[0] = diffOut[i-3];
-            edgesR[1] = diffOut[i-2];
-            edgesG[1] = diffOut[i-1];
-            
-            // Right
-            edgesR[2] = diffOut[i+4];
-            edgesG[2] = diffOut[i+5];
-            edgesR[3] = diffOut[i+6];
-            edgesG[3] = diffOut[i+7];
+void DiffFileSink::begin(ImData & /* im */, int bandWidth)
+{
+    width  = bandWidth;
+    height = 0;
+    min = max = 0;
+
+    // The 8 bit output is scaled by the largest absolute value of the whole frame, so the bands are spilled to a
+    // temporary file until that is known. The values can need more than 16 bits but the steps along a row are the
+    // 16 bit difference values, so a row is spilled as its first value and then the steps.
+    spill = tmpfile();
+    if (spill == NULL)
+        printf("Error in DiffFileSink::begin(): could not create a temporary file\n");
+}
 
-            cubicInterpol(interpolR, edgesR);
-            cubicInterpol(interpolG, edgesG);
+void DiffFileSink::consume(Band & band)
+{
+    int bandMin, bandMax;
+    int len = band.numRows*band.width;
+    getMinMax(&bandMin, &bandMax, band.data, 0, len);
+    if (height == 0 || bandMin < min)
+        min = bandMin;
+    if (height == 0 || bandMax > max)
+        max = bandMax;
+    height += band.numRows;
+
+    if (spill == NULL)
+        return;
+    std::vector<int16_t> steps(band.width);
+    for (int i = 0; i < band.numRows; i++)
+    {
+        const int * row = band.data + long(i)*band.width;
+        for (int j = 1; j < band.width; j++)
+            steps[j] = int16_t(row[j] - row[j - 1]);
+        fwrite(&row[0], sizeof(int), 1, spill);
+        fwrite(&steps[1], sizeof(int16_t), band.width - 1, spill);
+    }
+}
 
-            // diffOut[i - 1] = -2000; // For debugging and indicating the start of a defect region.
+void DiffFileSink::finish()
+{
+    if (spill == NULL)
+        return;
 
-            // diffOut[i + 0] = interpolR[0];
-            // diffOut[i + 1] = interpolG[0];
-            // diffOut[i + 2] = interpolR[1];
-            // diffOut[i + 3] = interpolG[1];
+    printf("the Bayer (min,max) = (%d, %d)\n", min, max);
+    int absmax = (abs(min) > abs(max)) ? abs(min) : abs(max) ;
+    printf("Absmax = %d\n", absmax);
 
-            // diffOut[i + 0] = 0;
-            // diffOut[i + 1] = 0;
-            // diffOut[i + 2] = 0;
-            // diffOut[i + 3] = 0;
+    FILE * filep = fopen(fname, "wb");
+    if (filep == NULL)
+    {
+        printf("\n error writing to file \n");
+        fclose(spill);
+        return;
+    }
+    fwrite(&width,  sizeof(width),  1, filep);
+    fwrite(&height, sizeof(height), 1, filep);
 
-        }
+    // One row at a time, integrated back from its first value and steps
+    std::vector<int16_t> steps(width);
+    std::vector<int> values(width);
+    std::vector<uchar> chars(width);
+    rewind(spill);
+    long numWrites = 0;
+    for (int i = 0; i < height; i++)
+    {
+        if (fread(&values[0], sizeof(int), 1, spill) != 1 || 
+            fread(&steps[1], sizeof(int16_t), width - 1, spill) != size_t(width - 1))
+            break;
+        for (int j = 1; j < width; j++)
+            values[j] = values[j - 1] + steps[j];
+        toUCharRow(&chars[0], &values[0], width, absmax);
+        numWrites += fwrite(&chars[0], sizeof(uchar), width, filep);
     }
+    if (numWrites != long(width)*height)
+        printf("\n error writing to file \n");
 
+    fclose(spill);
+    fclose(filep);
 }
 
 void printFatLine()
@@ -955,52 +5920,239 @@ unsigned char toUChar(int dVal, int maxAbs)
     return (unsigned char) ((dVal + maxAbs)*(128/float(maxAbs)));
 }
 
+void toUCharRow(uchar * dst, const int * src, long n, int maxAbs)
+{
+    // toUChar over a whole buffer. The same float reciprocal is multiplied in and truncated to 32 bits before the
+    // low byte is kept, so the bytes are identical to toUChar's, also for the values beyond maxAbs that wrap around.
+    float scale = 128/float(maxAbs);
+    long i = 0;
+#ifdef __AVX2__
+    const __m256i offset8 = _mm256_set1_epi32(maxAbs);
+    const __m256  scale8  = _mm256_set1_ps(scale);
+    const __m256i low8    = _mm256_set1_epi32(0xFF);
+    const __m256i order   = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i q [4];
+        for (int k = 0; k < 4; k++)
+        {
+            __m256i v = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *) (src + i + 8*k)), offset8);
+            q[k] = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(v), scale8)), low8);
+        }
+        // The packs work within 128 bit lanes, the permute puts the bytes back in order
+        __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(q[0], q[1]), _mm256_packs_epi32(q[2], q[3]));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_permutevar8x32_epi32(bytes, order));
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i offset = _mm_set1_epi32(maxAbs);
+    const __m128  scale4 = _mm_set1_ps(scale);
+    const __m128i low    = _mm_set1_epi32(0xFF);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i q [4];
+        for (int k = 0; k < 4; k++)
+        {
+            __m128i v = _mm_add_epi32(_mm_loadu_si128((const __m128i *) (src + i + 4*k)), offset);
+            q[k] = _mm_and_si128(_mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(v), scale4)), low);
+        }
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+        _mm_storeu_si128((__m128i *) (dst + i), bytes);
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = toUChar(src[i], maxAbs);
+}
+
 
 void huffCodes(uint8_t * huffData, uint16_t * table)
 {
-    // [0,1] then shift << 1 and add 0 , 1 repeat
-    int tabCount = 0;
-    int numNotUsed = 2;
-    int numUsed    = 0;
-    uint16_t unusedCodes [300];
-    uint16_t usedCodes   [300];
-    uint16_t temp          [300];
-    unusedCodes[0] = 0;
-    unusedCodes[1] = 1;
+    // Canonical codes as JPEG assigns them: the next code of a length is one more than the last, and moving to the next
+    // length appends a 0. Same codes as taking the smallest unused code, without a list of unused codes that grows
+    // with every length a short table leaves empty. The tables hold at most HUFF_MAX_VALUES codes.
+    uint16_t code = 0;
+    for (int i = 0, k = 0; i < 16; i++, code <<= 1)
+    {
+        for (int j = 0; j < huffData[i] && k < HUFF_MAX_VALUES; j++)
+            table[k++] = code++;
+    }
+}
+
+void HuffTable::build(uint8_t * huffData, int * huffValues)
+{
+    uint16_t codes [HUFF_MAX_VALUES];
+    huffCodes(huffData, codes);
 
-    for (int i = 0; i < 16; i++)
+    minLen = 0;
+    maxLen = 0;
+    numCodes = 0;
+    slowPathHits = 0;
+    for (int i = 0; i < (1 << HUFF_LOOKAHEAD); i++)
+        lookup[i] = 0;
+
+    for (int L = 1; L <= 16; L++)
     {
-        // Use a number of unused codes
-        int num = huffData[i];
-        for (int j = 0; j < num; j++)
-            usedCodes[numUsed + j] = unusedCodes[j];
+        int num = huffData[L-1];
 
-        // Remove those codes from unused codes list
-        numUsed += num;
-        for (int j = num; j < numNotUsed; j++)
-            temp[j-num] = unusedCodes[j];
-        numNotUsed -= num;
+        valPtr[L]  = numCodes;
+        minCode[L] = num ? codes[numCodes] : 0;
+        maxCode[L] = num ? codes[numCodes + num - 1] : -1;
 
-        // Update new codes
-        for (int j = 0; j < numNotUsed; j++)
+        for (int n = numCodes; n < numCodes + num; n++)
         {
-            unusedCodes[2*j + 0] = (temp[j]<<1) + 0;
-            unusedCodes[2*j + 1] = (temp[j]<<1) + 1;
+            values[n] = huffValues[n];
+
+            // Every window of HUFF_LOOKAHEAD bits starting with this code resolves to it
+            if (L <= HUFF_LOOKAHEAD)
+            {
+                int first = codes[n] << (HUFF_LOOKAHEAD - L);
+                int last  = first + (1 << (HUFF_LOOKAHEAD - L));
+                for (int k = first; k < last; k++)
+                    lookup[k] = (L << 8) | values[n];
+            }
         }
-        numNotUsed *= 2;
+
+        if (num && minLen == 0)
+            minLen = L;
+        if (num)
+            maxLen = L;
+        numCodes += num;
+    }
+}
+
+bool HuffTable::decode(uint16_t window, int windowLen, int & codeLen, int & codeValue)
+{
+    // The window holds the next windowLen bits of the stream, most significant bit first
+    int index = windowLen > HUFF_LOOKAHEAD ? window >> (windowLen - HUFF_LOOKAHEAD) 
+                                           : window << (HUFF_LOOKAHEAD - windowLen);
+    uint16_t entry = lookup[index];
+    if (entry)
+    {
+        codeLen   = entry >> 8;
+        codeValue = entry & 0xFF;
+        return true;
     }
 
-    for (int i = 0; i < numUsed; i++)
+    // Slow path, canonical decoding of the codes longer than HUFF_LOOKAHEAD
+    slowPathHits++;
+    for (int L = HUFF_LOOKAHEAD + 1; L <= windowLen; L++)
     {
-        table[i] = usedCodes[i];
+        int32_t code = window >> (windowLen - L);
+        if (code <= maxCode[L])
+        {
+            codeLen   = L;
+            codeValue = values[valPtr[L] + code - minCode[L]];
+            return true;
+        }
     }
+    return false;
 }
 
-void ByteStream::loadBytes(FILE * fp, long s)
+bool InputFile::open(const char * fname, bool useMmap)
+{
+    file = fopen(fname, "rb");
+    if (file == NULL)
+        return false;
+
+    pos = 0;
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0)
+        return true;
+
+    size = st.st_size;
+    if (!useMmap || size == 0)
+        return true;
+
+    void * m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (m == MAP_FAILED)
+    {
+        printf("Warning in InputFile::open(): mmap failed, falling back to fread\n");
+        return true;
+    }
+
+    // The headers are a few random reads at the start, the scan that makes up most of the file is read once from start to end
+    madvise(m, st.st_size, MADV_SEQUENTIAL);
+    madvise(m, st.st_size, MADV_WILLNEED);
+
+    map  = (const uint8_t *) m;
+    ownsMap = true;
+    return true;
+}
+
+void InputFile::open(const uint8_t * data, long dataSize)
+{
+    // Parsed and decoded like a mapped file, the bytes stay with the caller
+    close();
+    map  = data;
+    size = dataSize;
+    pos  = 0;
+    ownsMap = false;
+}
+
+void InputFile::close()
+{
+    if (map && ownsMap)
+        munmap((void *) map, size);
+    if (file)
+        fclose(file);
+    map  = NULL;
+    file = NULL;
+    size = 0;
+    ownsMap = false;
+}
+
+void InputFile::seek(long offset)
+{
+    if (map)
+        pos = offset;
+    else
+        fseek(file, offset, SEEK_SET);
+}
+
+long InputFile::tell()
+{
+    return map ? pos : ftell(file);
+}
+
+long InputFile::read(void * dst, long elSize, long count)
+{
+    if (!map)
+        return fread(dst, elSize, count, file);
+
+    long avail = pos < size ? (size - pos)/elSize : 0;
+    if (count > avail)
+        count = avail;
+    memcpy(dst, map + pos, elSize*count);
+    pos += elSize*count;
+    return count;
+}
+
+void ByteStream::mapBytes(const uint8_t * data, long s)
+{
+    release();
+    bytes = data;
+    size = s;
+    byteLoc = 0;
+}
+
+void ByteStream::release()
 {
+    if (ownsBytes)
+    {
+        delete [] bytes;
+        stats.release(size);
+    }
+    bytes = NULL;
+    ownsBytes = false;
+}
 
+void ByteStream::loadBytes(FILE * fp, long s)
+{
+    release();
     size = s;
-    bytes = new uint8_t [size];
+    uint8_t * buffer = new uint8_t [size];
+    bytes = buffer;
+    ownsBytes = true;
     long floc = ftell(fp);
 
     int fileErrorCode = ferror(fp);
@@ -1009,12 +6161,13 @@ void ByteStream::loadBytes(FILE * fp, long s)
         printf("fileErrorCode = %d\n", fileErrorCode);
     }
 
-    long numReadBytes = fread(bytes, sizeof(uint8_t), size, fp);
+    long numReadBytes = fread(buffer, sizeof(uint8_t), size, fp);
     if (numReadBytes != size)
     {
         printf("Warning in loadBytes(): Attempted to load %d bytes from file location %d \nManaged to read %d bytes\n\n", size, floc, numReadBytes);
     }
     size = numReadBytes;
+    stats.alloc(size);
 }
 
 uint16_t ByteStream::readBits(int N)
@@ -1026,26 +6179,9 @@ uint16_t ByteStream::readBits(int N)
         uint8_t byte = bytes[byteLoc];
         if (byte == 0xFF && (byteLoc + 1 < size))
         {
+            // Markers are only counted here, they are reported once the scan is decoded
             if (bytes[byteLoc + 1] != 0x00)
-            {
-                printf("Byteloc  = %d\n", byteLoc);
-                printf("Bitstart = %d\n", bitStart);
-                printBits(uint16_t(bitBuffer>>16)); printf(" ");
-                printBits(uint16_t((bitBuffer<<16)>>16));
-                printf("\n\n");
-                printBits(bytes[byteLoc]); printf(" ");
-                printBits(bytes[byteLoc+1]);
-                printf("\n");
-
-                printf("\n");
-
-                // printf("byteLoc = %d\nSize = %d\n", byteLoc, size);
-                if (byteLoc != size - 2)
-                {
-                    printf("We encountered an unexpected marker! byteLoc = %d\n", byteLoc + 1);
-                    printf("Marker : %x%x \n", bytes[byteLoc], bytes[byteLoc+1]);    
-                }
-            }
+                markers++;
             else
                 byteLoc++;
         }
@@ -1054,9 +6190,222 @@ uint16_t ByteStream::readBits(int N)
         bitStart -= 8;
         count ++;
     }
-    uint32_t temp = bitBuffer << bitStart;
+    // Past the end of the bytes the stream reads as zeros
+    uint32_t temp = bitStart < 32 ? bitBuffer << bitStart : 0;
     bitStart += N;
-    return uint16_t(temp >> (32 - N));
+    return N ? uint16_t(temp >> (32 - N)) : 0;
+}
+
+long unstuffScalar(uint8_t * out, const uint8_t * in, long i, long size, long & markers)
+{
+    long o = 0;
+    while (i < size)
+    {
+        uint8_t byte = in[i++];
+        out[o++] = byte;
+        if (byte == 0xFF && i < size)
+        {
+            if (in[i] == 0x00)
+                i++;
+            else
+                markers++;
+        }
+    }
+    return o;
+}
+
+long unstuff(uint8_t * out, const uint8_t * stuffed, long stuffedSize, bool simd, long & markers)
+{
+    // Same rule as ByteStream::readBits, 0xFF 0x00 becomes 0xFF and any other 0xFF xx is kept as it is
+    long i = 0, o = 0;
+#ifdef __SSE2__
+    if (simd)
+    {
+        const __m128i ff = _mm_set1_epi8(char(0xFF));
+        while (i + 16 <= stuffedSize)
+        {
+            __m128i chunk = _mm_loadu_si128((const __m128i *) (stuffed + i));
+            _mm_storeu_si128((__m128i *) (out + o), chunk);
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, ff));
+            if (mask == 0)
+            {
+                i += 16;
+                o += 16;
+                continue;
+            }
+
+            // Keep everything up to and including the first 0xFF, then drop the stuffed zero after it
+            int n = __builtin_ctz(mask) + 1;
+            i += n;
+            o += n;
+            if (i < stuffedSize)
+            {
+                if (stuffed[i] == 0x00)
+                    i++;
+                else
+                    markers++;
+            }
+        }
+    }
+#endif
+    return o + unstuffScalar(out + o, stuffed, i, stuffedSize, markers);
+}
+
+void BitPump::reserve(long stuffedSize)
+{
+    // Unstuffing only ever shrinks the scan, so the buffer of an earlier scan of at least this size is reused
+    if (!ownsBytes || capacity < stuffedSize + BIT_PUMP_PADDING)
+    {
+        release();
+        capacity = stuffedSize + BIT_PUMP_PADDING;
+        bytes = new uint8_t [capacity];
+        ownsBytes = true;
+        stats.alloc(capacity);
+    }
+    markers = 0;
+    streamMap   = NULL;
+    streamFile  = NULL;
+    streamLeft  = streamCarry = 0;
+}
+
+void BitPump::finishLoad(long unstuffedSize)
+{
+    size = unstuffedSize;
+    memset(bytes + size, 0, BIT_PUMP_PADDING);
+    byteLoc = 0;
+    bitBuffer = 0;
+    bitCount = 0;
+}
+
+void BitPump::load(const uint8_t * stuffed, long stuffedSize, bool simd)
+{
+    reserve(stuffedSize);
+    finishLoad(unstuff(bytes, stuffed, stuffedSize, simd, markers));
+}
+
+void BitPump::load(FILE * fp, long stuffedSize, bool simd)
+{
+    // The scan is read UNSTUFF_CHUNK bytes at a time and unstuffed straight into the pump, so the stuffed scan is never
+    // held whole. A 0xFF at the end of a chunk waits for the byte after it at the start of the next one.
+    reserve(stuffedSize);
+    uint8_t * chunk = new uint8_t [UNSTUFF_CHUNK + 1];
+    long o = 0, carry = 0, left = stuffedSize;
+    while (left > 0)
+    {
+        long n = fread(chunk + carry, 1, left < UNSTUFF_CHUNK ? left : UNSTUFF_CHUNK, fp);
+        if (n <= 0)
+        {
+            printf("Warning in BitPump::load(): the scan ends %ld bytes early\n", left);
+            break;
+        }
+        left -= n;
+
+        long avail = carry + n;
+        long end   = left > 0 && chunk[avail - 1] == 0xFF ? avail - 1 : avail;
+        o += unstuff(bytes + o, chunk, end, simd, markers);
+        carry = avail - end;
+        if (carry)
+            chunk[0] = 0xFF;
+    }
+    if (carry)
+        bytes[o++] = 0xFF;
+    delete [] chunk;
+    finishLoad(o);
+}
+
+void BitPump::stream(const uint8_t * map, FILE * fp, long stuffedSize, bool simd)
+{
+    // Room for what is left of one chunk and the next one, see topUp()
+    reserve(2*UNSTUFF_CHUNK + 1);
+    if (fp && streamChunk == NULL)
+    {
+        streamChunk = new uint8_t [UNSTUFF_CHUNK + 1];
+        stats.alloc(UNSTUFF_CHUNK + 1);
+    }
+    streamMap   = map;
+    streamFile  = fp;
+    streamLeft  = stuffedSize;
+    streamCarry = 0;
+    streamSimd  = simd;
+    finishLoad(0);
+}
+
+void BitPump::topUp()
+{
+    // Once less than a chunk is left to decode, the rest is moved to the front and the next chunk unstuffed after it. 
+    // A 0xFF at the end of a chunk waits for the byte after it, as in load(FILE *).
+    if (size - byteLoc >= UNSTUFF_CHUNK || (streamLeft == 0 && streamCarry == 0))
+        return;
+    memmove(bytes, bytes + byteLoc, size - byteLoc);
+    size   -= byteLoc;
+    byteLoc = 0;
+
+    long n = streamLeft < UNSTUFF_CHUNK ? streamLeft : UNSTUFF_CHUNK;
+    const uint8_t * chunk;
+    long avail;
+    if (streamMap)
+    {
+        chunk = streamMap - streamCarry;
+        avail = streamCarry + n;
+        streamMap += n;
+    }
+    else
+    {
+        streamChunk[0] = 0xFF;
+        n = fread(streamChunk + streamCarry, 1, n, streamFile);
+        if (n < 0)
+            n = 0;
+        if (n == 0 && streamLeft > 0)
+            printf("Warning in BitPump::topUp(): the scan ends %ld bytes early\n", streamLeft);
+        chunk = streamChunk;
+        avail = streamCarry + n;
+    }
+    streamLeft = n > 0 ? streamLeft - n : 0;
+
+    long end = streamLeft > 0 && chunk[avail - 1] == 0xFF ? avail - 1 : avail;
+    size += unstuff(bytes + size, chunk, end, streamSimd, markers);
+    streamCarry = avail - end;
+    memset(bytes + size, 0, BIT_PUMP_PADDING);
+}
+
+void BitPump::release()
+{
+    if (ownsBytes)
+    {
+        delete [] bytes;
+        stats.release(capacity);
+    }
+    if (streamChunk)
+    {
+        delete [] streamChunk;
+        stats.release(UNSTUFF_CHUNK + 1);
+    }
+    bytes = NULL;
+    capacity = 0;
+    ownsBytes = false;
+    streamChunk = NULL;
+    streamMap   = NULL;
+    streamFile  = NULL;
+    streamLeft  = streamCarry = 0;
+}
+
+void BitPump::view(const BitPump & other)
+{
+    release();
+    bytes     = other.bytes;
+    size      = other.size;
+    markers   = other.markers;
+    ownsBytes = false;
+    seekBits(0);
+}
+
+void BitPump::seekBits(long bitPos)
+{
+    byteLoc   = bitPos >> 3;
+    bitBuffer = 0;
+    bitCount  = 0;
+    refill();
+    skipBits(bitPos & 7);
 }
 
 void ByteStream::print(int N)
@@ -1089,6 +6438,64 @@ void getMinMax(T * outMin, T * outMax, T * in, int start, int stop)
     *outMax = max;
 }
 
+template <>
+void getMinMax<int>(int * outMin, int * outMax, int * in, int start, int stop)
+{
+    // Min and max reduction in registers, the lanes are combined at the end
+    int min = in[start];
+    int max = in[start];
+    int i = start;
+#ifdef __AVX2__
+    if (stop - i >= 8)
+    {
+        __m256i vmin = _mm256_set1_epi32(min), vmax = vmin;
+        for (; i + 8 <= stop; i += 8)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+            vmin = _mm256_min_epi32(vmin, v);
+            vmax = _mm256_max_epi32(vmax, v);
+        }
+        int lanes [16];
+        _mm256_storeu_si256((__m256i *) lanes, vmin);
+        _mm256_storeu_si256((__m256i *) (lanes + 8), vmax);
+        for (int k = 0; k < 8; k++)
+        {
+            min = lanes[k] < min ? lanes[k] : min;
+            max = lanes[k + 8] > max ? lanes[k + 8] : max;
+        }
+    }
+#elif defined(__SSE2__)
+    if (stop - i >= 4)
+    {
+        // SSE2 has no 32 bit min and max, select with the comparison mask
+        __m128i vmin = _mm_set1_epi32(min), vmax = vmin;
+        for (; i + 4 <= stop; i += 4)
+        {
+            __m128i v  = _mm_loadu_si128((const __m128i *) (in + i));
+            __m128i lt = _mm_cmplt_epi32(v, vmin);
+            __m128i gt = _mm_cmpgt_epi32(v, vmax);
+            vmin = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, vmin));
+            vmax = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, vmax));
+        }
+        int lanes [8];
+        _mm_storeu_si128((__m128i *) lanes, vmin);
+        _mm_storeu_si128((__m128i *) (lanes + 4), vmax);
+        for (int k = 0; k < 4; k++)
+        {
+            min = lanes[k] < min ? lanes[k] : min;
+            max = lanes[k + 4] > max ? lanes[k + 4] : max;
+        }
+    }
+#endif
+    for (; i < stop; i++)
+    {
+        min = in[i] < min ? in[i] : min;
+        max = in[i] > max ? in[i] : max;
+    }
+    *outMin = min;
+    *outMax = max;
+}
+
 
 void toFile(const char * fname, unsigned char * data, int width, int height)
 {
@@ -1105,7 +6512,45 @@ void toFile(const char * fname, unsigned char * data, int width, int height)
     fclose(filep);
 }
 
-void printTiffTag(TIFF_TAG tiff_tag, FILE * fp)
+bool toFile16(const char * fname, uint16_t * data, int width, int height, int channels)
+{
+    FILE * filep = fopen(fname, "wb");
+    if (filep == NULL)
+    {
+        printf("\n error writing to file \n");
+        return false;
+    }
+
+    fwrite(&width,  sizeof(width),  1, filep);
+    fwrite(&height, sizeof(height), 1, filep);
+
+    long numWrites = fwrite(data, sizeof(uint16_t), long(channels)*width*height, filep);
+
+    bool ok = numWrites == long(channels)*width*height;
+    if (!ok)
+        printf("\n error writing to file \n");
+    
+    fclose(filep);
+    return ok;
+}
+
+void unslice(uint16_t * dst, const uint16_t * src, ImData & im)
+{
+    // The scan holds the slices one after the other, [count, width, lastWidth] from CR2_SLICE
+    int x0 = 0;
+    for (int k = 0; k <= im.cr2_slice[0]; k++)
+    {
+        int w = k < im.cr2_slice[0] ? im.cr2_slice[1] : im.cr2_slice[2];
+        for (int i = 0; i < im.sensor_height; i++)
+        {
+            memcpy(dst + long(i)*im.sensor_width + x0, src, w*sizeof(uint16_t));
+            src += w;
+        }
+        x0 += w;
+    }
+}
+
+void printTiffTag(TIFF_TAG tiff_tag, InputFile * in)
 {
     printThinLine();
     printTagInfo(tiff_tag);
@@ -1114,10 +6559,10 @@ void printTiffTag(TIFF_TAG tiff_tag, FILE * fp)
     if ( dataSizeTag(tiff_tag) > 4 )
     {
         printf(" : Pointer type");
-        long currentOffset = ftell(fp);
-        fseek(fp, tiff_tag.value, SEEK_SET);
-        printPointerDataTag(tiff_tag, fp);
-        fseek(fp, currentOffset, SEEK_SET);
+        long currentOffset = in->tell();
+        in->seek(tiff_tag.value);
+        printPointerDataTag(tiff_tag, in);
+        in->seek(currentOffset);
     }
     printThinLine();
     printf("\n");
@@ -1129,12 +6574,28 @@ int dataSizeTag(TIFF_TAG tag)
 }
 
 template <typename T>
-void freadVar(T* varPtr, FILE * file)
+void freadVar(T* varPtr, InputFile * in)
+{
+    in->read(varPtr, sizeof(*varPtr), 1);
+}
+
+void readTagString(TIFF_TAG tag, InputFile * in, char * dst, int dstSize)
 {
-    fread(varPtr, sizeof(*varPtr), 1, file);
+    // ASCII tags of up to 4 bytes are stored in the value itself
+    int len = tag.values < uint32_t(dstSize) ? tag.values : dstSize - 1;
+    if (tag.values <= 4)
+        memcpy(dst, &tag.value, len);
+    else
+    {
+        long currentOffset = in->tell();
+        in->seek(tag.value);
+        in->read(dst, 1, len);
+        in->seek(currentOffset);
+    }
+    dst[len] = 0;
 }
 
-void printPointerDataTag(TIFF_TAG tag, FILE * f)
+void printPointerDataTag(TIFF_TAG tag, InputFile * in)
 {
     char charString[255];
     uint16_t ushortString[255];
@@ -1149,11 +6610,11 @@ void printPointerDataTag(TIFF_TAG tag, FILE * f)
 
             break;
         case 2 : // string (with an ending zero)
-            fread(&charString, sizeof(char), tag.values, f);
+            in->read(&charString, sizeof(char), tag.values);
             printf("\nValue (Ptr) : %0.*s", tag.values, charString);
             break;
         case 3 :  // unsigned short (2 bytes)
-            fread(&ushortString, sizeof(uint16_t), tag.values, f);
+            in->read(&ushortString, sizeof(uint16_t), tag.values);
             printf("\nValue (Ptr) : [");
             for (int i = 0; i < tag.values-1; i++)
                 printf("%d, ", ushortString[i]);
@@ -1163,7 +6624,7 @@ void printPointerDataTag(TIFF_TAG tag, FILE * f)
             break;
         case 5 :
             // printf("Type        : %s", "unsigned rationnal (2 unsigned long)");
-            fread(&ulongString, sizeof(uint32_t), 2, f);
+            in->read(&ulongString, sizeof(uint32_t), 2);
             printf("\nValue (Ptr) : %d / %d", ulongString[0], ulongString[1]);
             break;
         case 6 :
@@ -1183,7 +6644,7 @@ void printPointerDataTag(TIFF_TAG tag, FILE * f)
 
             break;
         case 10: // signed rationnal (2 signed long)
-            fread(&longString, sizeof(uint32_t), 2, f);
+            in->read(&longString, sizeof(uint32_t), 2);
             printf("\nValue (Ptr) : %d / %d", longString[0], longString[1]);
             break;
         case 11:
@@ -1191,7 +6652,7 @@ void printPointerDataTag(TIFF_TAG tag, FILE * f)
 
             break;
         case 12: // float, 8 bytes, IEEE format
-            fread(&dIEEE, sizeof(double), 1, f);
+            in->read(&dIEEE, sizeof(double), 1);
             printf("\nValue (Ptr) : %f", dIEEE);
             break;
         default: